@@ -0,0 +1,179 @@
+#include "pch.h"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+
+//Benchmarks are disabled by default, run them with --gtest_also_run_disabled_tests
+//and an optimized build. Results are printed, nothing is asserted.
+
+template<int N>
+struct BenchComponent : public IComponent<BenchComponent<N>> {
+	int value;
+};
+
+template<class F>
+static double BenchNanosPerOp(size_t ops, F &&f) {
+	auto start = std::chrono::high_resolution_clock::now();
+	f();
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+TEST(Benchmarks, DISABLED_ArchetypeLookup) {
+	World::Setup();
+	EntityManager *em = World::GetEntityManager();
+	ComponentManager *cm = World::GetComponentManager();
+
+	std::vector<EntityArchetype> archetypes;
+	archetypes.push_back(EntityArchetype::Create<BenchComponent<0>, BenchComponent<1>>());
+	archetypes.push_back(EntityArchetype::Create<BenchComponent<0>, BenchComponent<2>>());
+	archetypes.push_back(EntityArchetype::Create<BenchComponent<1>, BenchComponent<2>, BenchComponent<3>>());
+	archetypes.push_back(EntityArchetype::Create<BenchComponent<0>, BenchComponent<1>, BenchComponent<2>,
+		BenchComponent<3>, BenchComponent<4>, BenchComponent<5>>());
+
+	//The old scheme used the hash alone as the archetype identity
+	std::vector<EntityArchetype> stored(archetypes);
+	std::unordered_map<type_hash, size_t, util::typehasher> hashIndices;
+	for (size_t i = 0; i < archetypes.size(); ++i) {
+		hashIndices.emplace(archetypes[i].ArchetypeHash(), i);
+	}
+
+	const size_t lookups = 20000000;
+	size_t found = 0;
+
+	double hashOnly = BenchNanosPerOp(lookups, [&]() {
+		for (size_t i = 0; i < lookups; ++i) {
+			found += hashIndices.find(archetypes[i & 3].ArchetypeHash())->second;
+		}
+	});
+
+	//The current scheme confirms the hash match with a signature compare
+	double withSignature = BenchNanosPerOp(lookups, [&]() {
+		for (size_t i = 0; i < lookups; ++i) {
+			const EntityArchetype &archetype = archetypes[i & 3];
+			size_t idx = hashIndices.find(archetype.ArchetypeHash())->second;
+			if (stored[idx] == archetype) {
+				found += idx;
+			}
+		}
+	});
+
+	const size_t moves = 2000000;
+	Entity e = em->CreateEntity(archetypes[0]);
+	double move = BenchNanosPerOp(moves, [&]() {
+		for (size_t i = 0; i < moves; ++i) {
+			cm->MoveToArchetype(e, archetypes[(i + 1) & 3]);
+		}
+	});
+
+	printf("hash lookup: %.1f ns, hash + signature lookup: %.1f ns, MoveToArchetype: %.1f ns (%zu)\n",
+		hashOnly, withSignature, move, found);
+}
+
+
+class ScalingBenchSystem : public IComponentSystem<TestComponent2> {
+public:
+	ScalingBenchSystem() {
+		parallel = true;
+	}
+
+	virtual void DoWork(double deltaTime, const ComponentDatablock<TestComponent2> &components) override {
+		ComponentDataIterator<TestComponent2> data = components.Get<TestComponent2>();
+		for (size_t i = 0; i < components.size(); i++) {
+			data[i].testFloat = std::sqrt(data[i].testFloat + std::sin((float)i));
+		}
+	}
+};
+
+//Worker counts come from GLECS_BENCH_WORKERS, eg. "0,1,3,7,15". The calling thread always helps.
+static std::vector<size_t> BenchWorkerCounts() {
+	std::vector<size_t> counts;
+	const char *env = std::getenv("GLECS_BENCH_WORKERS");
+	if (env != nullptr) {
+		std::stringstream stream(env);
+		std::string item;
+		while (std::getline(stream, item, ',')) {
+			counts.push_back((size_t)std::stoul(item));
+		}
+	}
+	if (counts.empty()) {
+		counts = { 0, 1, 3, 7, 15 };
+	}
+	return counts;
+}
+
+TEST(Benchmarks, DISABLED_ParallelSystemScaling) {
+	World::Setup();
+	EntityManager *em = World::GetEntityManager();
+	ComponentManager *cm = World::GetComponentManager();
+	SystemManager *sm = World::GetSystemManager();
+
+	ScalingBenchSystem *system = new ScalingBenchSystem();
+	sm->RegisterSystem(system);
+	em->CreateEntities(1000000, EntityArchetype::Create<TestComponent2>());
+
+	std::vector<ComponentDatablock<TestComponent2>> data;
+	cm->GetComponentDataBlocks(data, system->GetQuery());
+
+	//Same dispatch as the system executor, on a pool of the requested size
+	const size_t frames = 20;
+	for (size_t workers : BenchWorkerCounts()) {
+		ThreadPool pool(workers);
+		double ms = BenchNanosPerOp(frames, [&]() {
+			for (size_t f = 0; f < frames; ++f) {
+				pool.ParallelFor(data.size(), system->parallelBatchSize, [system, &data](size_t i) {
+					system->DoWork(1.0, data[i]);
+				});
+			}
+		}) / 1e6;
+		printf("%zu workers: %.2f ms/frame (%zu chunks)\n", workers, ms, data.size());
+	}
+
+	double updateMs = BenchNanosPerOp(frames, [&]() {
+		for (size_t f = 0; f < frames; ++f) {
+			sm->Update(World::GetWorldAccessor(), 1.0);
+		}
+	}) / 1e6;
+	printf("SystemManager::Update on the shared pool (%zu workers): %.2f ms/frame\n",
+		ThreadPool::instance().ThreadCount(), updateMs);
+}
+
+
+//400k entities in one archetype, then random destroy + spawn rounds and random add/remove rounds
+TEST(Benchmarks, DISABLED_StructuralChurn) {
+	World::Setup();
+	EntityManager *em = World::GetEntityManager();
+	ComponentManager *cm = World::GetComponentManager();
+
+	const size_t numents = 400000;
+	EntityArchetype archetype = EntityArchetype::Create<TestComponent2>();
+	EntityArray arr = em->CreateEntities(numents, archetype);
+	std::vector<Entity> live(arr.begin(), arr.end());
+	std::mt19937 rng(1);
+
+	const size_t rounds = 200000;
+	double spawn = BenchNanosPerOp(rounds, [&]() {
+		for (size_t i = 0; i < rounds; ++i) {
+			size_t k = rng() % live.size();
+			em->DestroyEntity(live[k]);
+			live[k] = em->CreateEntity(archetype);
+		}
+	});
+
+	double addRemove = BenchNanosPerOp(rounds, [&]() {
+		for (size_t i = 0; i < rounds; ++i) {
+			Entity e = live[rng() % live.size()];
+			if (cm->HasComponent<TestComponent1>(e)) {
+				cm->RemoveComponent<TestComponent1>(e);
+			} else {
+				cm->AddComponent<TestComponent1>(e);
+			}
+		}
+	});
+
+	printf("destroy + spawn churn: %.0f ns/op, add/remove churn: %.0f ns/op, %zu blocks\n",
+		spawn, addRemove, cm->GetMemoryBlockCount());
+}
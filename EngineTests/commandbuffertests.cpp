@@ -0,0 +1,155 @@
+#include "pch.h"
+#include <thread>
+
+
+TEST(CommandBuffers, CreateAndSet) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	EntityCommandBuffer buffer;
+
+	TestComponent1 value;
+	value.testValue = 5;
+
+	Entity deferred = buffer.CreateEntity(EntityArchetype::Create<TestComponent1>());
+	buffer.SetComponent(deferred, value);
+	buffer.AddComponent<TestComponent2>(deferred);
+	ASSERT_FALSE(entitymanager->IsAlive(deferred));
+	ASSERT_EQ(buffer.Size(), 3);
+
+	buffer.Playback(World::GetWorldAccessor());
+	ASSERT_TRUE(buffer.Empty());
+
+	std::vector<ComponentMemoryBlock*> blocks;
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1, TestComponent2>().Build());
+	ASSERT_EQ(blocks.size(), 1);
+	ASSERT_EQ(blocks[0]->size(), 1);
+
+	Entity e = blocks[0]->GetEntityArray()[0];
+	ASSERT_TRUE(entitymanager->IsAlive(e));
+	ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, 5);
+}
+
+
+TEST(CommandBuffers, DeferredChangesWhileIterating) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	const size_t numents = 10000;
+	EntityArray arr = entitymanager->CreateEntities(numents, EntityArchetype::Create<TestComponent1>());
+
+	std::vector<ComponentDatablock<TestComponent1>> data;
+	World::GetWorldAccessor().GetComponentData(data);
+
+	EntityCommandBuffer buffer;
+	for (const ComponentDatablock<TestComponent1> &block : data) {
+		EntityIterator entities = block.GetEntities();
+		for (size_t i = 0; i < block.size(); ++i) {
+			Entity e = entities[i];
+			if (e.ID % 3 == 0) {
+				buffer.DestroyEntity(e);
+			} else if (e.ID % 3 == 1) {
+				TestComponent2 value;
+				value.testBigint = e.ID;
+				buffer.AddComponent(e, value);
+			} else {
+				buffer.RemoveComponent<TestComponent1>(e);
+			}
+		}
+	}
+
+	buffer.Playback(World::GetWorldAccessor());
+
+	for (Entity e : arr) {
+		if (e.ID % 3 == 0) {
+			ASSERT_FALSE(entitymanager->IsAlive(e));
+		} else if (e.ID % 3 == 1) {
+			ASSERT_TRUE(componentmanager->HasComponent<TestComponent1>(e));
+			ASSERT_EQ(componentmanager->GetComponent<TestComponent2>(e).testBigint, e.ID);
+		} else {
+			ASSERT_FALSE(componentmanager->HasComponent<TestComponent1>(e));
+		}
+	}
+}
+
+
+TEST(CommandBuffers, RemovedValuesDontSurvive) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	Entity e = entitymanager->CreateEntity(EntityArchetype::Create<TestComponent1>());
+	componentmanager->GetComponent<TestComponent1>(e).testValue = 9;
+
+	TestComponent1 value;
+	value.testValue = 7;
+
+	EntityCommandBuffer buffer;
+	buffer.SetComponent(e, value);
+	buffer.RemoveComponent<TestComponent1>(e);
+	buffer.AddComponent<TestComponent1>(e);
+	buffer.Playback(World::GetWorldAccessor());
+
+	ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, 0);
+
+	//Also when the entity ends up in another archetype
+	componentmanager->GetComponent<TestComponent1>(e).testValue = 9;
+	buffer.RemoveComponent<TestComponent1>(e);
+	buffer.AddComponent<TestComponent2>(e);
+	buffer.AddComponent<TestComponent1>(e);
+	buffer.Playback(World::GetWorldAccessor());
+
+	ASSERT_TRUE(componentmanager->HasComponent<TestComponent2>(e));
+	ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, 0);
+
+	//Commands for entities that died in the meantime are skipped
+	buffer.AddComponent<TestComponent2>(e);
+	entitymanager->DestroyEntity(e);
+	buffer.Playback(World::GetWorldAccessor());
+	ASSERT_FALSE(entitymanager->IsAlive(e));
+}
+
+
+TEST(CommandBuffers, MergeFromThreads) {
+	World::Setup();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	const int numThreads = 4;
+	const int perThread = 1000;
+
+	EntityCommandBuffer merged;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < numThreads; ++t) {
+		threads.emplace_back([&merged, t]() {
+			EntityCommandBuffer local;
+			for (int i = 0; i < perThread; ++i) {
+				Entity e = local.CreateEntity(EntityArchetype::Create<TestComponent1>());
+				TestComponent1 value;
+				value.testValue = t * perThread + i;
+				local.SetComponent(e, value);
+			}
+			merged.Merge(local);
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	ASSERT_EQ(merged.Size(), numThreads * perThread * 2);
+	merged.Playback(World::GetWorldAccessor());
+
+	std::vector<ComponentMemoryBlock*> blocks;
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1>().Build());
+
+	std::vector<int> seen(numThreads * perThread, 0);
+	for (ComponentMemoryBlock *block : blocks) {
+		for (size_t i = 0; i < block->size(); ++i) {
+			seen[block->GetComponent<TestComponent1>(i).testValue]++;
+		}
+	}
+	for (int count : seen) {
+		ASSERT_EQ(count, 1);
+	}
+}
@@ -62,4 +62,76 @@ TEST(ComponentQueries, Match) {
 	ASSERT_FALSE(filter4.Matches(archetype_all));
 	ASSERT_FALSE(filter4.Matches(archetype_components));
 	ASSERT_TRUE(filter4.Matches(archetype_sharedcomponents));
-}
\ No newline at end of file
+}
+TEST(ComponentQueries, RegistryIndices) {
+	size_t index1 = util::GetComponentIndex<TestComponent1>();
+	size_t index2 = util::GetComponentIndex<TestComponent2>();
+	size_t indexShared = util::GetComponentIndex<TestSharedComponent1>();
+
+	ASSERT_NE(index1, index2);
+	ASSERT_NE(index1, indexShared);
+	ASSERT_LT(index1, ComponentRegistry::instance().Count());
+	ASSERT_LT(indexShared, ComponentRegistry::instance().Count());
+
+	ASSERT_EQ(ComponentRegistry::instance().FindIndex(TestComponent2::ComponentTypeID), index2);
+	ASSERT_EQ(ComponentRegistry::instance().GetInfo(index1).type, TestComponent1::ComponentTypeID);
+	ASSERT_EQ(ComponentRegistry::instance().GetInfo(index1).memorySize, sizeof(TestComponent1));
+	ASSERT_FALSE(ComponentRegistry::instance().GetInfo(index1).shared);
+	ASSERT_TRUE(ComponentRegistry::instance().GetInfo(indexShared).shared);
+
+	ASSERT_EQ(ComponentType::Get<TestComponent1>().index, index1);
+}
+
+TEST(ComponentQueries, Mask) {
+	ComponentMask empty;
+	ComponentMask a;
+	ComponentMask b;
+
+	a.Set(1);
+	a.Set(130);
+	b.Set(130);
+
+	ASSERT_TRUE(a.Test(130));
+	ASSERT_FALSE(a.Test(2));
+	ASSERT_TRUE(a.ContainsAll(b));
+	ASSERT_FALSE(b.ContainsAll(a));
+	ASSERT_TRUE(a.ContainsAll(empty));
+	ASSERT_TRUE(a.ContainsAny(b));
+	ASSERT_FALSE(a.ContainsAny(empty));
+
+	b.Set(1);
+	ASSERT_TRUE(a == b);
+	b.Reset(130);
+	ASSERT_TRUE(a != b);
+}
+
+TEST(ComponentQueries, Cached) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+	TestSharedComponent1 shared;
+
+	entitymanager->CreateEntities(10, EntityArchetype::Create<TestComponent1>());
+	entitymanager->CreateEntities(10, EntityArchetype::Create<TestComponent2>());
+
+	ComponentQuery query = ComponentQueryBuilder().Include<TestComponent1>().Build();
+	query_id id = componentmanager->RegisterQuery(query);
+	ASSERT_EQ(componentmanager->RegisterQuery(query), id);
+	ASSERT_EQ(componentmanager->GetMatchingArchetypes(id).size(), 1);
+
+	//Archetypes created after registering are picked up
+	entitymanager->CreateEntities(10, EntityArchetype::Create<TestComponent1, TestComponent2>());
+	entitymanager->CreateEntities(10, EntityArchetype::Create<TestComponent2>(&shared));
+	ASSERT_EQ(componentmanager->GetMatchingArchetypes(id).size(), 2);
+
+	std::vector<ComponentMemoryBlock*> cachedBlocks;
+	std::vector<ComponentMemoryBlock*> matchedBlocks;
+	componentmanager->GetMemoryBlocks(cachedBlocks, id);
+	componentmanager->GetMemoryBlocks(matchedBlocks, query);
+	ASSERT_EQ(cachedBlocks, matchedBlocks);
+
+	World::Setup();
+	ASSERT_EQ(componentmanager->GetMatchingArchetypes(id).size(), 0);
+	entitymanager->CreateEntities(10, EntityArchetype::Create<TestComponent1>());
+	ASSERT_EQ(componentmanager->GetMatchingArchetypes(id).size(), 1);
+}
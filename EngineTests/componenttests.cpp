@@ -212,6 +212,45 @@ TEST(Components, MoveManyIndividually) {
 }
 
 
+TEST(Components, MoveIntoSameArchetype) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	EntityArchetype archetype1 = EntityArchetype::Create<TestComponent1>();
+	EntityArchetype archetype12 = EntityArchetype::Create<TestComponent1, TestComponent2>();
+
+	const size_t numents = 1000;
+	EntityArray ents1 = entitymanager->CreateEntities(numents, archetype1);
+	EntityArray ents12 = entitymanager->CreateEntities(numents, archetype12);
+
+	std::vector<Entity> mixed;
+	for (size_t i = 0; i < numents; ++i) {
+		componentmanager->GetComponent<TestComponent1>(ents1[i]).testValue = (int)i;
+		componentmanager->GetComponent<TestComponent1>(ents12[i]).testValue = (int)(numents + i);
+		mixed.push_back(ents1[i]);
+		mixed.push_back(ents12[i]);
+	}
+
+	//Moving to the archetype the entity is already in does nothing
+	componentmanager->MoveToArchetype(ents12[0], archetype12);
+	componentmanager->MoveToArchetype(mixed.data(), mixed.size(), archetype12);
+
+	for (size_t i = 0; i < numents; ++i) {
+		ASSERT_EQ(componentmanager->GetEntityArchetype(ents1[i]), archetype12);
+		ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(ents1[i]).testValue, (int)i);
+		ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(ents12[i]).testValue, (int)(numents + i));
+	}
+
+	std::vector<ComponentMemoryBlock*> blocks;
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1, TestComponent2>().Build());
+	size_t total = 0;
+	for (ComponentMemoryBlock *block : blocks) {
+		total += block->size();
+	}
+	ASSERT_EQ(total, numents * 2);
+}
+
 TEST(Components, CreateEntityFromArchetype) {
 	World::Setup();
 	EntityManager *entitymanager = World::GetEntityManager();
@@ -233,4 +272,255 @@ TEST(Components, CreateEntityFromArchetype) {
 		ASSERT_TRUE(componentmanager->HasComponent<TestComponent2>(e));
 	}
 
-}
\ No newline at end of file
+}
+
+TEST(Components, CreateManyFromArchetype) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	EntityArchetype archetype = EntityArchetype::Create<TestComponent1, TestComponent2>();
+
+	//Free some IDs so the batch mixes reused and new IDs
+	EntityArray first = entitymanager->CreateEntities(100, archetype);
+	for (size_t i = 0; i < first.size; i += 2) {
+		entitymanager->DestroyEntity(first[i]);
+	}
+
+	const size_t numents = 10000;
+	EntityArray arr = entitymanager->CreateEntities(numents, archetype);
+
+	size_t i = 0;
+	for (Entity e : arr) {
+		ASSERT_TRUE(entitymanager->IsAlive(e));
+		ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, 0);
+		ASSERT_EQ(componentmanager->GetComponent<TestComponent2>(e).testBigint, 0);
+		componentmanager->GetComponent<TestComponent1>(e).testValue = (int)i++;
+	}
+
+	i = 0;
+	for (Entity e : arr) {
+		ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, (int)i++);
+	}
+
+	std::vector<ComponentDatablock<TestComponent1>> blocks;
+	size_t total = 0;
+	World::GetWorldAccessor().GetComponentData(blocks);
+	for (auto &block : blocks) {
+		total += block.size();
+	}
+	ASSERT_EQ(total, numents + first.size / 2);
+}
+
+TEST(Components, ToggleComponent) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	EntityArchetype archetype = EntityArchetype::Create<TestComponent2>();
+
+	const size_t numents = 1000;
+	EntityArray arr = entitymanager->CreateEntities(numents, archetype);
+
+	for (Entity e : arr) {
+		componentmanager->GetComponent<TestComponent2>(e).testBigint = e.ID;
+	}
+
+	componentmanager->AddComponent<TestComponent1>(arr[0]);
+	componentmanager->RemoveComponent<TestComponent1>(arr[0]);
+	size_t numArchetypes = componentmanager->GetArchetypeCount();
+
+	for (int i = 0; i < 10; i++) {
+		for (Entity e : arr) {
+			componentmanager->AddComponent<TestComponent1>(e).testValue = i;
+		}
+		for (Entity e : arr) {
+			ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, i);
+			componentmanager->RemoveComponent<TestComponent1>(e);
+		}
+	}
+
+	ASSERT_EQ(componentmanager->GetArchetypeCount(), numArchetypes);
+
+	for (Entity e : arr) {
+		ASSERT_FALSE(componentmanager->HasComponent<TestComponent1>(e));
+		ASSERT_EQ(componentmanager->GetComponent<TestComponent2>(e).testBigint, e.ID);
+	}
+}
+
+TEST(Components, Compact) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+	MemoryBlockAllocator &allocator = MemoryBlockAllocator::instance();
+
+	EntityArchetype archetype = EntityArchetype::Create<TestComponent1>();
+	EntityArchetype other = EntityArchetype::Create<TestComponent2>();
+
+	const size_t numents = 6000;
+	EntityArray arr = entitymanager->CreateEntities(numents, archetype);
+	EntityArray others = entitymanager->CreateEntities(10, other);
+	for (Entity e : arr) {
+		componentmanager->GetComponent<TestComponent1>(e).testValue = e.ID;
+	}
+
+	size_t blocksBefore = componentmanager->GetMemoryBlockCount();
+
+	//Leave every block sparse, and the last one empty
+	std::vector<ComponentMemoryBlock*> blocks;
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1>().Build());
+	size_t perBlock = blocks[0]->maxSize();
+	for (size_t i = 0; i < numents; ++i) {
+		if (i % 3 != 0 || i >= perBlock * (blocks.size() - 1)) {
+			entitymanager->DestroyEntity(arr[i]);
+		}
+	}
+	size_t alive = 0;
+	for (Entity e : arr) {
+		alive += entitymanager->IsAlive(e);
+	}
+
+	//Empty blocks aren't handed to queries
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1>().Build());
+	ASSERT_EQ(blocks.size(), (numents + perBlock - 1) / perBlock - 1);
+
+	//No time budget still makes progress, one emptied block per call, so an archetype takes several calls
+	size_t calls = 1;
+	size_t blockCount = componentmanager->GetMemoryBlockCount();
+	while (!componentmanager->Compact(std::chrono::nanoseconds(0))) {
+		ASSERT_LE(componentmanager->GetMemoryBlockCount(), blockCount);
+		blockCount = componentmanager->GetMemoryBlockCount();
+		++calls;
+	}
+	ASSERT_GT(calls, componentmanager->GetArchetypeCount());
+
+	ASSERT_LT(componentmanager->GetMemoryBlockCount(), blocksBefore);
+	ASSERT_EQ(allocator.NumAllocatedBlocks(), componentmanager->GetMemoryBlockCount());
+
+	//Memory of the freed blocks is given back separately
+	ASSERT_GT(allocator.ReleaseFreeMemory(), 0);
+	ASSERT_EQ(allocator.ReleaseFreeMemory(), 0);
+
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1>().Build());
+	ASSERT_EQ(blocks.size(), (alive + perBlock - 1) / perBlock);
+
+	for (Entity e : arr) {
+		if (entitymanager->IsAlive(e)) {
+			ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, e.ID);
+		}
+	}
+	for (Entity e : others) {
+		ASSERT_TRUE(componentmanager->HasComponent<TestComponent2>(e));
+	}
+
+	//Entity locations stay valid for structural changes after compaction
+	for (Entity e : arr) {
+		if (entitymanager->IsAlive(e)) {
+			componentmanager->AddComponent<TestComponent2>(e).testBigint = e.ID;
+		}
+	}
+	for (Entity e : arr) {
+		if (entitymanager->IsAlive(e)) {
+			ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, e.ID);
+			ASSERT_EQ(componentmanager->GetComponent<TestComponent2>(e).testBigint, e.ID);
+		}
+	}
+}
+
+TEST(Components, ReuseFreeSlots) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	EntityArchetype archetype = EntityArchetype::Create<TestComponent1>();
+
+	std::vector<ComponentMemoryBlock*> blocks;
+	EntityArray arr = entitymanager->CreateEntities(5000, archetype);
+	size_t numBlocks = componentmanager->GetMemoryBlockCount();
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1>().Build());
+	size_t perBlock = blocks[0]->maxSize();
+
+	//Free one slot in each of the full blocks, new entities fill those before anything else
+	size_t freed = 0;
+	for (size_t i = 0; i + perBlock <= arr.size; i += perBlock) {
+		entitymanager->DestroyEntity(arr[i]);
+		++freed;
+	}
+	size_t room = numBlocks * perBlock - arr.size;
+	EntityArray refill = entitymanager->CreateEntities(freed + room, archetype);
+	ASSERT_EQ(componentmanager->GetMemoryBlockCount(), numBlocks);
+
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1>().Build());
+	for (ComponentMemoryBlock *block : blocks) {
+		ASSERT_FALSE(block->HasRoom());
+	}
+
+	entitymanager->CreateEntity(archetype);
+	ASSERT_EQ(componentmanager->GetMemoryBlockCount(), numBlocks + 1);
+}
+
+struct TestStringComponent : public IComponent<TestStringComponent> {
+	std::string value;
+	static int alive;
+
+	TestStringComponent() { ++alive; }
+	TestStringComponent(TestStringComponent&& other) : value(std::move(other.value)) { ++alive; }
+	~TestStringComponent() { --alive; }
+};
+int TestStringComponent::alive = 0;
+
+TEST(Components, NonTrivialLifetimes) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	ASSERT_TRUE(ComponentRegistry::instance().GetInfo(util::GetComponentIndex<TestComponent1>()).IsTrivial());
+	ASSERT_FALSE(ComponentRegistry::instance().GetInfo(util::GetComponentIndex<TestStringComponent>()).IsTrivial());
+
+	EntityArchetype archetype = EntityArchetype::Create<TestStringComponent>();
+
+	const size_t numents = 3000;
+	EntityArray arr = entitymanager->CreateEntities(numents, archetype);
+	ASSERT_EQ(TestStringComponent::alive, numents);
+
+	//Long enough to live on the heap
+	auto expected = [](const Entity &e) { return std::string(40, 'a' + e.ID % 26) + std::to_string(e.ID); };
+	for (Entity e : arr) {
+		componentmanager->GetComponent<TestStringComponent>(e).value = expected(e);
+	}
+
+	//Archetype moves, swap removals, batch removals and compaction all move the strings
+	for (size_t i = 0; i < numents; i += 2) {
+		componentmanager->AddComponent<TestComponent1>(arr[i]);
+	}
+	for (size_t i = 0; i < numents; i += 4) {
+		componentmanager->RemoveComponent<TestComponent1>(arr[i]);
+	}
+	for (size_t i = 1; i < numents; i += 3) {
+		entitymanager->DestroyEntity(arr[i]);
+	}
+	std::vector<Entity> alive;
+	for (size_t i = 5; i < numents; i += 10) {
+		if (entitymanager->IsAlive(arr[i])) {
+			alive.push_back(arr[i]);
+		}
+	}
+	EntityArray batch;
+	batch.size = alive.size();
+	batch.data.reset(new Entity[alive.size()]);
+	std::copy(alive.begin(), alive.end(), batch.begin());
+	entitymanager->DestroyEntities(batch);
+	componentmanager->Compact(std::chrono::seconds(10));
+
+	size_t numAlive = 0;
+	for (Entity e : arr) {
+		if (entitymanager->IsAlive(e)) {
+			ASSERT_EQ(componentmanager->GetComponent<TestStringComponent>(e).value, expected(e));
+			++numAlive;
+		}
+	}
+	ASSERT_EQ(TestStringComponent::alive, numAlive);
+
+	World::Setup();
+	ASSERT_EQ(TestStringComponent::alive, 0);
+}
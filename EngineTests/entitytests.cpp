@@ -60,10 +60,39 @@ TEST(Entities, DestroyArraysIDReuse) {
 	EntityArray entArr2 = manager->CreateEntities(entityArrSize);
 
 	for (Entity e : entArr) {
-		ASSERT_TRUE(std::find(entArr2.begin(), entArr2.end(), e) != entArr2.end());
+		auto found = std::find_if(entArr2.begin(), entArr2.end(), [e](const Entity& e2) { return e2.ID == e.ID; });
+		ASSERT_TRUE(found != entArr2.end());
+		ASSERT_NE(found->version, e.version) << "Reused ID should have a new version";
 	}
 }
 
+TEST(Entities, StaleHandle) {
+	World::Setup();
+	EntityManager *manager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	Entity e1 = manager->CreateEntity();
+	manager->DestroyEntity(e1);
+
+	ASSERT_FALSE(manager->IsAlive(e1));
+
+	Entity e2 = manager->CreateEntity();
+	componentmanager->AddComponent<TestComponent1>(e2);
+
+	ASSERT_EQ(e1.ID, e2.ID);
+	ASSERT_NE(e1, e2) << "Stale handle should not alias the new entity";
+
+	ASSERT_FALSE(manager->IsAlive(e1));
+	ASSERT_TRUE(manager->IsAlive(e2));
+
+	manager->DestroyEntity(e2);
+	Entity e3 = manager->CreateEntity();
+
+	ASSERT_FALSE(manager->IsAlive(e1));
+	ASSERT_FALSE(manager->IsAlive(e2));
+	ASSERT_TRUE(manager->IsAlive(e3));
+}
+
 TEST(Entities, IsAlive) {
 	World::Setup();
 	EntityManager *manager = World::GetEntityManager();
@@ -278,3 +307,61 @@ TEST(EntityArchetypes, CreateTemplate) {
 	ASSERT_TRUE(archetype.HasSharedComponentType(TestSharedComponent2::ComponentTypeID));
 }
 
+
+TEST(Entities, DestroyArraysKeepsSurvivors) {
+	World::Setup();
+	EntityManager *manager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	EntityArchetype archetype = EntityArchetype::Create<TestComponent1>();
+
+	const size_t numents = 10000;
+	EntityArray arr = manager->CreateEntities(numents, archetype);
+
+	for (Entity e : arr) {
+		componentmanager->GetComponent<TestComponent1>(e).testValue = e.ID;
+	}
+
+	//Destroy every third entity in one batch
+	EntityArray victims;
+	victims.size = numents / 3;
+	victims.data = std::shared_ptr<Entity[]>(new Entity[victims.size]);
+	for (size_t i = 0; i < victims.size; ++i) {
+		victims.data[i] = arr[i * 3];
+	}
+
+	manager->DestroyEntities(victims);
+
+	for (size_t i = 0; i < numents; ++i) {
+		Entity e = arr[i];
+		if (i % 3 == 0 && i / 3 < victims.size) {
+			ASSERT_FALSE(manager->IsAlive(e));
+		} else {
+			ASSERT_TRUE(manager->IsAlive(e));
+			ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, e.ID);
+		}
+	}
+}
+
+TEST(EntityArchetypes, Equality) {
+	TestSharedComponent1 shared1;
+	TestSharedComponent1 shared2;
+
+	EntityArchetype archetype1 = EntityArchetype(ComponentType::Get<TestComponent1>());
+	EntityArchetype archetype2 = EntityArchetype(ComponentType::Get<TestComponent2>());
+	EntityArchetype archetype12 = archetype1.AddComponent(ComponentType::Get<TestComponent2>());
+	EntityArchetype archetype21 = archetype2.AddComponent(ComponentType::Get<TestComponent1>());
+
+	ASSERT_TRUE(archetype12 == archetype21);
+	ASSERT_FALSE(archetype1 == archetype2);
+	ASSERT_FALSE(archetype1 == archetype12);
+	ASSERT_TRUE(archetype12.RemoveComponent(ComponentType::Get<TestComponent2>()) == archetype1);
+
+	EntityArchetype withShared1 = archetype1.AddSharedComponent(&shared1);
+	EntityArchetype withShared2 = archetype1.AddSharedComponent(&shared2);
+
+	ASSERT_FALSE(withShared1 == withShared2);
+	ASSERT_FALSE(withShared1 == archetype1);
+	ASSERT_TRUE(withShared1 == EntityArchetype::Create<TestComponent1>(&shared1));
+	ASSERT_TRUE(withShared1.RemoveSharedComponent(TestSharedComponent1::ComponentTypeID) == archetype1);
+}
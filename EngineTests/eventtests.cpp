@@ -145,6 +145,40 @@ TEST(Events, SendEvents) {
 }
 
 
+TEST(Events, QueueHandle) {
+
+	World::Setup();
+	EventManager *eventmanager = World::GetEventManager();
+
+	ASSERT_NE(util::GetEventIndex<EntityCreatedEvent>(), util::GetEventIndex<EntityDestroyedEvent>());
+	ASSERT_EQ(util::GetEventIndex<TestEvent1>(), util::GetEventIndex<TestEvent1>());
+
+	TestEvent1Listener testListener;
+	eventmanager->RegisterListener(&testListener);
+
+	EventQueue<TestEvent1> &queue = eventmanager->GetEventQueue<TestEvent1>();
+	ASSERT_EQ(&queue, &eventmanager->GetEventQueue<TestEvent1>());
+
+	unsigned long long sum = 0;
+	for (int i = 0; i < 1000; ++i) {
+		sum += i;
+		TestEvent1 event;
+		event.testInt = i;
+		queue.AddEvent(event);
+	}
+
+	//events queued through the manager end up in the same queue
+	TestEvent1 event;
+	event.testInt = 5;
+	eventmanager->QueueEvent(event);
+	sum += 5;
+
+	eventmanager->DeliverEvents();
+
+	ASSERT_EQ(testListener.sumOfEvents, 1001);
+	ASSERT_EQ(testListener.sumOfValues, sum);
+}
+
 TEST(Events, CreateEntityEvents) {
 
 	World::Setup();
@@ -658,3 +692,310 @@ TEST(Events, SharedComponentMove) {
 		ASSERT_EQ(c, shared1);
 	}
 }
+
+TEST(Events, BatchedMoveEventsKeepOrder) {
+	World::Setup();
+	EventManager *eventmanager = World::GetEventManager();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	ComponentEventSpawner::instance().RegisterEventSpawnerForComponent<TestComponent1>();
+
+	EntityArchetype archetype1 = EntityArchetype::Create<TestComponent1>();
+	EntityArchetype archetype2 = EntityArchetype::Create<TestComponent2>();
+	EntityArchetype archetype12 = EntityArchetype::Create<TestComponent1, TestComponent2>();
+
+	const size_t numentities = 1000;
+
+	EntityArray ents1 = entitymanager->CreateEntities(numentities, archetype1);
+	EntityArray ents12 = entitymanager->CreateEntities(numentities, archetype12);
+	eventmanager->DeliverEvents();
+
+	//runs of different source archetypes
+	std::vector<Entity> mixed;
+	for (size_t i = 0; i < numentities; ++i) {
+		mixed.push_back(ents1[i]);
+		if (i % 3 == 0) {
+			mixed.push_back(ents12[i]);
+		}
+	}
+
+	ComponentRemovedEventListener removedListener;
+	ComponentAddedEventListener addedListener;
+	eventmanager->RegisterListener(&removedListener);
+	eventmanager->RegisterListener(&addedListener);
+
+	componentmanager->MoveToArchetype(mixed.data(), mixed.size(), archetype2);
+	eventmanager->DeliverEvents();
+
+	ASSERT_EQ(removedListener.entities, mixed);
+	ASSERT_EQ(addedListener.sumOfEvents, 0);
+
+	componentmanager->MoveToArchetype(mixed.data(), mixed.size(), archetype12);
+	eventmanager->DeliverEvents();
+
+	ASSERT_EQ(addedListener.entities, mixed);
+	ASSERT_EQ(removedListener.entities.size(), mixed.size());
+
+	for (Entity e : mixed) {
+		ASSERT_TRUE(componentmanager->HasComponent<TestComponent1>(e));
+	}
+}
+
+class TestEvent1RecordingListener : public IEventListener<TestEvent1> {
+public:
+	std::vector<int> values;
+
+	void ProcessEvents(const EventIterator<TestEvent1> &eventIterator) override {
+		for (const TestEvent1 &event : eventIterator) {
+			values.push_back(event.testInt);
+		}
+	}
+};
+
+TEST(Events, ConcurrentProducers) {
+	World::Setup();
+	EventManager *eventmanager = World::GetEventManager();
+
+	TestEvent1RecordingListener testListener;
+	eventmanager->RegisterListener(&testListener);
+
+	ThreadPool pool(3);
+	const size_t numJobs = 64;
+	const int eventsPerJob = 100;
+
+	//keyed producers are merged by key, whichever thread ran the job
+	pool.ParallelFor(numJobs, 1, [&](size_t job) {
+		EventProducer<TestEvent1> producer = eventmanager->GetEventProducer<TestEvent1>(numJobs - job);
+		for (int i = 0; i < eventsPerJob; ++i) {
+			TestEvent1 event;
+			event.testInt = (int)(numJobs - job) * eventsPerJob + i;
+			producer.AddEvent(event);
+		}
+	});
+
+	TestEvent1 first;
+	first.testInt = -1;
+	eventmanager->QueueEvent(first);
+
+	eventmanager->DeliverEvents();
+
+	ASSERT_EQ(testListener.values.size(), numJobs * eventsPerJob + 1);
+	ASSERT_EQ(testListener.values[0], -1);
+	for (size_t i = 1; i < testListener.values.size(); ++i) {
+		ASSERT_EQ(testListener.values[i], (int)(i - 1) + eventsPerJob);
+	}
+
+	//per-thread buffers
+	testListener.values.clear();
+	EventQueue<TestEvent1> &queue = eventmanager->GetEventQueue<TestEvent1>();
+	pool.ParallelFor(numJobs * eventsPerJob, 16, [&](size_t i) {
+		TestEvent1 event;
+		event.testInt = (int)i;
+		queue.AddEventConcurrent(event);
+	});
+
+	eventmanager->DeliverEvents();
+
+	std::sort(testListener.values.begin(), testListener.values.end());
+	ASSERT_EQ(testListener.values.size(), numJobs * eventsPerJob);
+	for (size_t i = 0; i < testListener.values.size(); ++i) {
+		ASSERT_EQ(testListener.values[i], (int)i);
+	}
+}
+
+class MainThreadTestEvent1Listener : public IEventListener<TestEvent1> {
+public:
+	int sumOfEvents = 0;
+	bool onOtherThread = false;
+	std::thread::id mainThread = std::this_thread::get_id();
+
+	void ProcessEvents(const EventIterator<TestEvent1> &eventIterator) override {
+		onOtherThread |= std::this_thread::get_id() != mainThread;
+		sumOfEvents += (int)eventIterator.size;
+	}
+};
+
+TEST(Events, ParallelDelivery) {
+	World::Setup();
+	EventManager *eventmanager = World::GetEventManager();
+	EntityManager *entitymanager = World::GetEntityManager();
+
+	ThreadPool pool(3);
+	eventmanager->SetParallelDelivery(true, pool);
+
+	TestEvent1Listener listeners[8];
+	for (TestEvent1Listener &listener : listeners) {
+		eventmanager->RegisterListener(&listener);
+	}
+
+	MainThreadTestEvent1Listener mainThreadListener;
+	mainThreadListener.mainThreadOnly = true;
+	eventmanager->RegisterListener(&mainThreadListener);
+
+	EntityCreatedEventListener createdListener;
+	eventmanager->RegisterListener(&createdListener);
+
+	const int numEvents = 1000;
+	unsigned long long sum = 0;
+	for (int i = 0; i < numEvents; ++i) {
+		sum += i;
+		TestEvent1 event;
+		event.testInt = i;
+		eventmanager->QueueEvent(event);
+	}
+	entitymanager->CreateEntities(100);
+
+	eventmanager->DeliverEvents();
+
+	for (TestEvent1Listener &listener : listeners) {
+		ASSERT_EQ(listener.sumOfEvents, numEvents);
+		ASSERT_EQ(listener.sumOfValues, sum);
+	}
+	ASSERT_EQ(mainThreadListener.sumOfEvents, numEvents);
+	ASSERT_FALSE(mainThreadListener.onOtherThread);
+	ASSERT_EQ(createdListener.sumOfEntities, 100);
+
+	//queues are emptied after delivery
+	eventmanager->DeliverEvents();
+	ASSERT_EQ(mainThreadListener.sumOfEvents, numEvents);
+
+	World::Setup();
+}
+
+//Counts a received event down by queuing it again with testInt - 1
+class CountdownListener : public IEventListener<TestEvent1> {
+public:
+	EventManager *eventmanager;
+	std::vector<int> values;
+
+	void ProcessEvents(const EventIterator<TestEvent1> &eventIterator) override {
+		for (const TestEvent1 &event : eventIterator) {
+			values.push_back(event.testInt);
+			if (event.testInt > 0) {
+				TestEvent1 next;
+				next.testInt = event.testInt - 1;
+				//lands in the other buffer, the iterator stays valid
+				for (int i = 0; i < 100; ++i) {
+					eventmanager->QueueEvent(next);
+				}
+			}
+		}
+	}
+};
+
+TEST(Events, MultiPassDelivery) {
+	World::Setup();
+	EventManager *eventmanager = World::GetEventManager();
+
+	CountdownListener listener;
+	listener.eventmanager = eventmanager;
+	eventmanager->RegisterListener(&listener);
+
+	TestEvent1 event;
+	event.testInt = 1;
+	eventmanager->QueueEvent(event);
+
+	//one pass by default, events queued during delivery wait
+	eventmanager->DeliverEvents();
+	ASSERT_EQ(listener.values.size(), 1);
+	ASSERT_TRUE(eventmanager->HasPendingEvents());
+
+	eventmanager->DeliverEvents();
+	ASSERT_EQ(listener.values.size(), 101);
+	ASSERT_FALSE(eventmanager->HasPendingEvents());
+
+	//deliver until nothing is left
+	listener.values.clear();
+	eventmanager->SetMaxDeliveryPasses(10);
+	event.testInt = 2;
+	eventmanager->QueueEvent(event);
+	eventmanager->DeliverEvents();
+	ASSERT_EQ(listener.values.size(), 1 + 100 + 100 * 100);
+	ASSERT_FALSE(eventmanager->HasPendingEvents());
+
+	//stops at the pass limit
+	listener.values.clear();
+	eventmanager->SetMaxDeliveryPasses(2);
+	event.testInt = 3;
+	eventmanager->QueueEvent(event);
+	eventmanager->DeliverEvents();
+	ASSERT_EQ(listener.values.size(), 1 + 100);
+	ASSERT_TRUE(eventmanager->HasPendingEvents());
+}
+
+struct TestSpawningEvent : public IEvent<TestSpawningEvent> {
+	int testInt;
+};
+
+struct TestMiddleEvent : public IEvent<TestMiddleEvent> {
+	int testInt;
+};
+
+struct TestSpawnedEvent : public IEvent<TestSpawnedEvent> {
+	int testInt;
+};
+
+//Queues an event type no queue exists for yet
+class SpawningListener : public IEventListener<TestSpawningEvent> {
+public:
+	EventManager *eventmanager;
+
+	void ProcessEvents(const EventIterator<TestSpawningEvent> &eventIterator) override {
+		for (const TestSpawningEvent &event : eventIterator) {
+			TestSpawnedEvent spawned;
+			spawned.testInt = event.testInt;
+			eventmanager->QueueEvent(spawned);
+		}
+	}
+};
+
+class SpawnedListener : public IEventListener<TestSpawnedEvent> {
+public:
+	int sumOfEvents = 0;
+
+	void ProcessEvents(const EventIterator<TestSpawnedEvent> &eventIterator) override {
+		sumOfEvents += (int)eventIterator.size;
+	}
+};
+
+TEST(Events, QueueCreatedDuringDelivery) {
+	//Fix the order of the queues: the spawning one, another one after it, then the new one
+	util::GetEventIndex<TestSpawningEvent>();
+	util::GetEventIndex<TestMiddleEvent>();
+	util::GetEventIndex<TestSpawnedEvent>();
+
+	for (int parallel = 0; parallel < 2; ++parallel) {
+		//A fresh manager whose queue vector ends at the middle queue, so the new queue makes it reallocate
+		EventManager eventmanager;
+		ThreadPool pool(2);
+		eventmanager.SetParallelDelivery(parallel == 1, pool);
+		eventmanager.SetMaxDeliveryPasses(2);
+
+		TestMiddleEvent middle;
+		middle.testInt = 0;
+		eventmanager.QueueEvent(middle);
+
+		SpawningListener spawningListener;
+		spawningListener.eventmanager = &eventmanager;
+		spawningListener.mainThreadOnly = true;
+		eventmanager.RegisterListener(&spawningListener);
+
+		TestSpawningEvent event;
+		event.testInt = 1;
+		eventmanager.QueueEvent(event);
+
+		//Nobody listens to the new type yet, its event is dropped
+		eventmanager.DeliverEvents();
+		ASSERT_FALSE(eventmanager.HasPendingEvents());
+
+		//Now the spawned event is delivered within the same DeliverEvents call
+		SpawnedListener spawnedListener;
+		eventmanager.RegisterListener(&spawnedListener);
+		eventmanager.QueueEvent(event);
+		eventmanager.DeliverEvents();
+
+		ASSERT_EQ(spawnedListener.sumOfEvents, 1);
+		ASSERT_FALSE(eventmanager.HasPendingEvents());
+	}
+}
@@ -109,8 +109,10 @@ TEST(ComponentMemoryBlock, RemoveEntityFromMiddle) {
 	ASSERT_EQ(e2idx, 0);
 	//check that component moved with the entity
 	ASSERT_EQ(test_val, memblock.GetComponentArray<TestComponent1>()[e2idx].testValue);
+#ifndef ECS_ZERO_ON_REUSE
 	//check that memory was reset
 	ASSERT_EQ(0, memblock.GetComponentArray<TestComponent1>()[1].testValue);
+#endif //ECS_ZERO_ON_REUSE
 
 	ASSERT_EQ(memblock.GetEntityArray()[0], e2);
 }
@@ -149,10 +151,11 @@ TEST(ComponentMemoryBlock, RemoveLastEntity) {
 	ASSERT_EQ(moved.ID, ENTITY_NULL_ID);
 
 	ASSERT_EQ(ents[0], e1);
-	ASSERT_EQ(ents[1], Entity());
-
 	ASSERT_EQ(carr[0].testValue, 2);
+#ifndef ECS_ZERO_ON_REUSE
+	ASSERT_EQ(ents[1], Entity());
 	ASSERT_EQ(carr[1].testValue, 0);
+#endif //ECS_ZERO_ON_REUSE
 }
 
 TEST(ComponentMemoryBlock, RemoveOnlyEntity) {
@@ -187,8 +190,10 @@ TEST(ComponentMemoryBlock, RemoveOnlyEntity) {
 
 	ASSERT_FALSE(memblock.HasEntity(e1));
 
+#ifndef ECS_ZERO_ON_REUSE
 	ASSERT_EQ(carr[0].testValue, 0);
 	ASSERT_EQ(ents[0], Entity());
+#endif //ECS_ZERO_ON_REUSE
 
 	ASSERT_EQ(memblock.size(), 0);
 }
@@ -244,10 +249,12 @@ TEST(ComponentMemoryBlock, MoveEntity) {
 
 
 	ASSERT_FALSE(memblock1.HasEntity(e1));
+#ifndef ECS_ZERO_ON_REUSE
 	ASSERT_EQ(ents1[0], Entity());
 	ASSERT_EQ(ctarr1[0].testValue, 0);
 	ASSERT_EQ(carr1[0].testBigint, 0);
 	ASSERT_EQ(carr1[0].testFloat, 0.0f);
+#endif //ECS_ZERO_ON_REUSE
 	ASSERT_EQ(memblock1.size(), 0);
 
 	ASSERT_TRUE(memblock2.HasEntity(e1));
@@ -290,3 +297,327 @@ TEST(ComponentMemoryBlock, MoveMany) {
 	}
 }
 
+
+TEST(MemoryBlockAllocator, ReuseFreedBlocks) {
+	World::Setup();
+	MemoryBlockAllocator &allocator = MemoryBlockAllocator::instance();
+
+	EntityArchetype archetype1 = EntityArchetype(ComponentType::Get<TestComponent1>());
+	EntityArchetype archetype2 = EntityArchetype(ComponentType::Get<TestComponent2>());
+
+	ComponentMemoryBlock *block1 = allocator.Allocate();
+	ComponentMemoryBlock *block2 = allocator.Allocate();
+	block1->Initialize(archetype1);
+	block2->Initialize(archetype1);
+
+	ASSERT_NE(block1, block2);
+	ASSERT_EQ(allocator.NumAllocatedBlocks(), 2);
+	size_t reserved = allocator.ReservedBytes();
+
+	allocator.Deallocate(block1);
+	ASSERT_EQ(allocator.NumAllocatedBlocks(), 1);
+
+	//Freed block is handed out again, even for a different archetype
+	ComponentMemoryBlock *block3 = allocator.Allocate();
+	block3->Initialize(archetype2);
+	ASSERT_EQ(block3, block1);
+	ASSERT_EQ(block3->size(), 0);
+	ASSERT_TRUE(block3->type.HasComponentType(TestComponent2::ComponentTypeID));
+	ASSERT_EQ(allocator.ReservedBytes(), reserved);
+
+	allocator.Deallocate(block2);
+	allocator.Deallocate(block3);
+	ASSERT_EQ(allocator.NumAllocatedBlocks(), 0);
+}
+
+TEST(MemoryBlockAllocator, ManyBlocks) {
+	World::Setup();
+	MemoryBlockAllocator &allocator = MemoryBlockAllocator::instance();
+
+	EntityArchetype archetype = EntityArchetype(ComponentType::Get<TestComponent1>());
+
+	const size_t numBlocks = 1000;
+	std::vector<ComponentMemoryBlock*> blocks;
+	for (size_t i = 0; i < numBlocks; ++i) {
+		ComponentMemoryBlock *block = allocator.Allocate();
+		block->Initialize(archetype);
+		blocks.push_back(block);
+	}
+
+	ASSERT_EQ(allocator.NumAllocatedBlocks(), numBlocks);
+
+	for (ComponentMemoryBlock *block : blocks) {
+		ASSERT_EQ(reinterpret_cast<uintptr_t>(block) % 64, 0);
+		ASSERT_EQ(block->size(), 0);
+	}
+
+	World::Setup();
+
+	ASSERT_EQ(allocator.NumAllocatedBlocks(), 0);
+	ASSERT_EQ(allocator.ReservedBytes(), 0);
+}
+
+TEST(ComponentMemoryBlock, RemoveMany) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+
+	EntityArchetype archetype12 = EntityArchetype()
+		.AddComponent(ComponentType::Get<TestComponent1>())
+		.AddComponent(ComponentType::Get<TestComponent2>());
+
+	ComponentMemoryBlock memblock;
+	memblock.Initialize(archetype12);
+
+	const size_t numents = 20;
+	EntityArray arr = entitymanager->CreateEntities(numents);
+	for (Entity e : arr) {
+		memblock.AddEntity(e);
+		memblock.GetComponent<TestComponent1>(e).testValue = e.ID;
+	}
+
+	//Remove from the start, middle and end
+	std::vector<size_t> victims = { 0, 3, 4, 10, 17, 19 };
+	std::vector<size_t> moved;
+	memblock.RemoveEntities(victims.data(), victims.size(), moved);
+
+	ASSERT_EQ(memblock.size(), numents - victims.size());
+
+	for (size_t idx : victims) {
+		ASSERT_FALSE(memblock.HasEntity(arr[idx]));
+	}
+
+	for (size_t i = 0; i < numents; ++i) {
+		if (std::find(victims.begin(), victims.end(), i) == victims.end()) {
+			ASSERT_TRUE(memblock.HasEntity(arr[i]));
+			ASSERT_EQ(memblock.GetComponent<TestComponent1>(arr[i]).testValue, arr[i].ID);
+		}
+	}
+
+	for (size_t idx : moved) {
+		ASSERT_LT(idx, memblock.size());
+	}
+
+#ifndef ECS_ZERO_ON_REUSE
+	//Tail was cleared
+	auto carr = memblock.GetComponentArray<TestComponent1>();
+	auto ents = memblock.GetEntityArray();
+	for (size_t i = memblock.size(); i < numents; ++i) {
+		ASSERT_EQ(carr[i].testValue, 0);
+		ASSERT_EQ(ents[i], Entity());
+	}
+#endif //ECS_ZERO_ON_REUSE
+}
+
+TEST(ComponentMemoryBlock, ManagedBlockLookups) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	EntityArchetype archetype12 = EntityArchetype()
+		.AddComponent(ComponentType::Get<TestComponent1>())
+		.AddComponent(ComponentType::Get<TestComponent2>());
+
+	const size_t numents = 100;
+	EntityArray arr = entitymanager->CreateEntities(numents, archetype12);
+	for (Entity e : arr) {
+		componentmanager->GetComponent<TestComponent1>(e).testValue = e.ID;
+	}
+
+	//Swap removals move entities around inside the block
+	for (size_t i = 0; i < numents; i += 3) {
+		entitymanager->DestroyEntity(arr[i]);
+	}
+
+	std::vector<ComponentMemoryBlock*> blocks;
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1, TestComponent2>().Build());
+	ASSERT_EQ(blocks.size(), 1);
+	ComponentMemoryBlock *block = blocks[0];
+
+	for (size_t i = 0; i < numents; ++i) {
+		if (i % 3 == 0) {
+			ASSERT_FALSE(block->HasEntity(arr[i]));
+		} else {
+			ASSERT_TRUE(block->HasEntity(arr[i]));
+			size_t idx = block->GetEntityIndex(arr[i]);
+			ASSERT_EQ(block->GetEntityArray()[idx], arr[i]);
+			ASSERT_EQ(block->GetComponent<TestComponent1>(arr[i]).testValue, arr[i].ID);
+		}
+	}
+
+	//Entities living in another archetype's block aren't found
+	Entity other = entitymanager->CreateEntity(EntityArchetype(ComponentType::Get<TestComponent1>()));
+	ASSERT_FALSE(block->HasEntity(other));
+}
+
+struct alignas(32) TestAlignedComponent : public IComponent<TestAlignedComponent> {
+	float values[8];
+};
+
+struct TestByteComponent : public IComponent<TestByteComponent> {
+	uint8_t value;
+};
+
+TEST(ComponentMemoryBlock, AlignedColumns) {
+	EntityArchetype archetype = EntityArchetype()
+		.AddComponent(ComponentType::Get<TestByteComponent>())
+		.AddComponent(ComponentType::Get<TestAlignedComponent>())
+		.AddComponent(ComponentType::Get<TestComponent2>());
+
+	ASSERT_EQ(ComponentType::Get<TestAlignedComponent>().alignment, 32);
+
+	ComponentMemoryBlock memblock;
+	memblock.Initialize(archetype);
+	ASSERT_GT(memblock.maxSize(), 0);
+
+	uint8_t *begin = memblock.data;
+	uint8_t *end = begin + ComponentMemoryBlock::datasize;
+
+	auto bytes = reinterpret_cast<uint8_t*>(memblock.GetComponentArray<TestByteComponent>());
+	auto aligned = reinterpret_cast<uint8_t*>(memblock.GetComponentArray<TestAlignedComponent>());
+	auto comp2 = reinterpret_cast<uint8_t*>(memblock.GetComponentArray<TestComponent2>());
+
+	ASSERT_EQ(reinterpret_cast<uintptr_t>(aligned) % ComponentMemoryBlock::ColumnAlignment<TestAlignedComponent>(), 0);
+	ASSERT_EQ(reinterpret_cast<uintptr_t>(comp2) % ComponentMemoryBlock::ColumnAlignment<TestComponent2>(), 0);
+	size_t iteratorAlignment = ComponentDataIterator<TestAlignedComponent>::alignment;
+	ASSERT_GE(iteratorAlignment, 32);
+
+	//Every column fits in the block
+	size_t n = memblock.maxSize();
+	ASSERT_LE(bytes + n * sizeof(TestByteComponent), end);
+	ASSERT_LE(aligned + n * sizeof(TestAlignedComponent), end);
+	ASSERT_LE(comp2 + n * sizeof(TestComponent2), end);
+	ASSERT_GE(bytes, begin + n * sizeof(Entity));
+}
+
+struct TestLargeComponent : public IComponent<TestLargeComponent> {
+	uint8_t state[2048];
+};
+
+TEST(ComponentMemoryBlock, ChunkSizes) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+	MemoryBlockAllocator &allocator = MemoryBlockAllocator::instance();
+
+	EntityArchetype small = EntityArchetype::Create<TestComponent1>();
+	EntityArchetype large = EntityArchetype::Create<TestLargeComponent>();
+	EntityArchetype hinted = EntityArchetype::Create<TestComponent2>().WithChunkSize(ChunkSize::Medium);
+
+	ASSERT_EQ(ComponentMemoryBlock::DataSizeFor(small), KB(16));
+	ASSERT_EQ(ComponentMemoryBlock::DataSizeFor(large), KB(256));
+	ASSERT_EQ(ComponentMemoryBlock::DataSizeFor(hinted), KB(64));
+	//The hint doesn't change the archetype's identity
+	ASSERT_EQ(hinted, EntityArchetype::Create<TestComponent2>());
+
+	EntityArray smallEnts = entitymanager->CreateEntities(10, small);
+	EntityArray largeEnts = entitymanager->CreateEntities(200, large);
+	entitymanager->CreateEntities(10, hinted);
+
+	ASSERT_EQ(allocator.NumAllocatedBlocks(KB(16)), 1);
+	ASSERT_EQ(allocator.NumAllocatedBlocks(KB(64)), 1);
+	ASSERT_EQ(allocator.NumAllocatedBlocks(KB(256)), 2);
+
+	std::vector<ComponentMemoryBlock*> blocks;
+	componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestLargeComponent>().Build());
+	ASSERT_EQ(blocks.size(), 2);
+	ASSERT_EQ(blocks[0]->dataSize(), KB(256));
+	ASSERT_GE(blocks[0]->maxSize(), 100);
+
+	for (Entity e : largeEnts) {
+		componentmanager->GetComponent<TestLargeComponent>(e).state[2047] = (uint8_t)e.ID;
+	}
+	for (Entity e : largeEnts) {
+		ASSERT_EQ(componentmanager->GetComponent<TestLargeComponent>(e).state[2047], (uint8_t)e.ID);
+	}
+
+	//Moving between archetypes crosses size classes
+	componentmanager->AddComponent<TestComponent1>(largeEnts[0]);
+	componentmanager->RemoveComponent<TestLargeComponent>(largeEnts[0]);
+	ASSERT_TRUE(componentmanager->HasComponent<TestComponent1>(largeEnts[0]));
+	ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(largeEnts[0]).testValue, 0);
+
+	World::Setup();
+	ASSERT_EQ(allocator.NumAllocatedBlocks(), 0);
+	ASSERT_EQ(allocator.ReservedBytes(), 0);
+}
+
+TEST(ComponentMemoryBlock, ReusedRowsStartZeroed) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+
+	EntityArchetype archetype12 = EntityArchetype()
+		.AddComponent(ComponentType::Get<TestComponent1>())
+		.AddComponent(ComponentType::Get<TestComponent2>());
+	EntityArchetype archetype1 = EntityArchetype(ComponentType::Get<TestComponent1>());
+
+	ComponentMemoryBlock memblock;
+	memblock.Initialize(archetype12);
+	ComponentMemoryBlock memblock1;
+	memblock1.Initialize(archetype1);
+
+	EntityArray arr = entitymanager->CreateEntities(4, archetype12);
+	for (Entity e : arr) {
+		size_t idx = memblock.AddEntity(e);
+		memblock.GetComponent<TestComponent1>(idx).testValue = 5;
+		memblock.GetComponent<TestComponent2>(idx).testBigint = 5;
+	}
+	std::vector<size_t> victims = { 2, 3 };
+	std::vector<size_t> moved;
+	memblock.RemoveEntities(victims.data(), victims.size(), moved);
+	ASSERT_EQ(memblock.RemoveEntityMoveLast(1).ID, ENTITY_NULL_ID);
+
+#ifdef ECS_POISON_MEMORY
+	uint8_t poison = ECS_POISON_BYTE;
+	ASSERT_EQ(reinterpret_cast<uint8_t*>(memblock.GetComponentArray<TestComponent1>() + 1)[0], poison);
+#endif
+
+	//Rows vacated above are reused, whatever the memory mode
+	EntityArray more = entitymanager->CreateEntities(3, archetype12);
+	size_t first = memblock.AddEntities(more.begin(), 2);
+	ASSERT_EQ(memblock.GetComponent<TestComponent1>(first).testValue, 0);
+	ASSERT_EQ(memblock.GetComponent<TestComponent2>(first + 1).testBigint, 0);
+
+	//Components the source doesn't have start zeroed too
+	size_t idx1 = memblock1.AddEntity(more[2]);
+	memblock1.GetComponent<TestComponent1>(idx1).testValue = 7;
+	size_t idx12 = memblock1.CopyEntityTo(idx1, more[2], &memblock);
+	ASSERT_EQ(memblock.GetComponent<TestComponent1>(idx12).testValue, 7);
+	ASSERT_EQ(memblock.GetComponent<TestComponent2>(idx12).testFloat, 0.0f);
+	ASSERT_EQ(memblock.GetComponent<TestComponent2>(idx12).testBigint, 0);
+}
+
+template <int N>
+struct TestNumberedComponent : public IComponent<TestNumberedComponent<N>> {
+	int value;
+};
+
+template <size_t ...N>
+static std::vector<ComponentType> NumberedComponentTypes(std::index_sequence<N...>) {
+	return { ComponentType::Get<TestNumberedComponent<(int)N>>()... };
+}
+
+TEST(ComponentMemoryBlock, ArchetypeComponentLimit) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	const size_t limit = ECS_MAX_ARCHETYPE_COMPONENTS;
+	std::vector<ComponentType> types = NumberedComponentTypes(std::make_index_sequence<ECS_MAX_ARCHETYPE_COMPONENTS + 3>());
+
+	//The limit itself works
+	EntityArchetype archetype;
+	for (size_t i = 0; i < limit; ++i) {
+		archetype = archetype.AddComponent(types[i]);
+	}
+	Entity e = entitymanager->CreateEntity(archetype);
+	componentmanager->GetComponent<TestNumberedComponent<5>>(e).value = 5;
+	ASSERT_EQ(componentmanager->GetComponent<TestNumberedComponent<5>>(e).value, 5);
+
+	//Going past it fails before any memory block sees the archetype
+	ASSERT_THROW(archetype.AddComponent(types[limit]), std::length_error);
+	ASSERT_THROW(componentmanager->AddComponent<TestNumberedComponent<ECS_MAX_ARCHETYPE_COMPONENTS + 2>>(e), std::length_error);
+	ASSERT_FALSE(componentmanager->HasComponent<TestNumberedComponent<ECS_MAX_ARCHETYPE_COMPONENTS + 2>>(e));
+
+	//Adding one that's already there is fine
+	ASSERT_EQ(archetype.AddComponent(types[0]).GetComponentTypes().size(), limit);
+}
@@ -92,4 +92,85 @@ TEST(SharedComponents, Destructor) {
 	World::Setup();
 
 	ASSERT_EQ(TestSharedComponentWithDestructor::numDestructions, numComponents);
-}
\ No newline at end of file
+}
+
+struct TestSharedMaterial : public ISharedComponent<TestSharedMaterial> {
+	int texture = 0;
+	float roughness = 0;
+
+	inline bool operator==(const TestSharedMaterial& other) const {
+		return texture == other.texture && roughness == other.roughness;
+	}
+};
+
+namespace std {
+	template<>
+	struct hash<TestSharedMaterial> {
+		size_t operator()(const TestSharedMaterial& m) const {
+			return hash<int>()(m.texture) ^ (hash<float>()(m.roughness) << 1);
+		}
+	};
+}
+
+TEST(SharedComponents, Interning) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	TestSharedMaterial value;
+	value.texture = 3;
+	value.roughness = 0.5f;
+
+	TestSharedMaterial *material1 = componentmanager->GetOrCreateSharedComponent(value);
+	TestSharedMaterial *material2 = componentmanager->GetOrCreateSharedComponent(value);
+
+	ASSERT_EQ(material1, material2);
+	ASSERT_EQ(material1->texture, 3);
+
+	value.texture = 4;
+	TestSharedMaterial *material3 = componentmanager->GetOrCreateSharedComponent(value);
+	ASSERT_NE(material1, material3);
+
+	//equal values share one archetype and fill the same memory blocks
+	Entity entity1 = entitymanager->CreateEntity(EntityArchetype::Create<TestComponent1>(material1));
+	Entity entity2 = entitymanager->CreateEntity(EntityArchetype::Create<TestComponent1>(material2));
+	ASSERT_EQ(componentmanager->GetSharedComponent<TestSharedMaterial>(entity1), material1);
+	ASSERT_EQ(componentmanager->GetSharedComponent<TestSharedMaterial>(entity2), material1);
+	ASSERT_EQ(componentmanager->GetMemoryBlockCount(), 1);
+
+	//interned instances are reference counted
+	size_t allocated = SharedComponentAllocator::instance().NumAllocated();
+	componentmanager->DestroySharedComponent(material1);
+	ASSERT_EQ(SharedComponentAllocator::instance().NumAllocated(), allocated);
+	componentmanager->DestroySharedComponent(material2);
+	ASSERT_EQ(SharedComponentAllocator::instance().NumAllocated(), allocated - 1);
+	componentmanager->DestroySharedComponent(material3);
+	ASSERT_EQ(SharedComponentAllocator::instance().NumAllocated(), allocated - 2);
+}
+
+//No std::hash, interned by operator== alone
+struct TestSharedLayer : public ISharedComponent<TestSharedLayer> {
+	int layer = 0;
+
+	inline bool operator==(const TestSharedLayer& other) const {
+		return layer == other.layer;
+	}
+};
+
+TEST(SharedComponents, InterningWithoutHash) {
+	World::Setup();
+	ComponentManager *componentmanager = World::GetComponentManager();
+
+	TestSharedLayer value;
+	value.layer = 1;
+	TestSharedLayer *layer1 = componentmanager->GetOrCreateSharedComponent(value);
+	value.layer = 2;
+	TestSharedLayer *layer2 = componentmanager->GetOrCreateSharedComponent(value);
+	value.layer = 1;
+	ASSERT_EQ(componentmanager->GetOrCreateSharedComponent(value), layer1);
+	ASSERT_NE(layer1, layer2);
+
+	//values of other types with the same hash are never compared against these
+	TestSharedMaterial material;
+	ASSERT_NE((void*)componentmanager->GetOrCreateSharedComponent(material), (void*)layer1);
+}
@@ -417,4 +417,162 @@ TEST(Systems, DataAccess) {
 	for (Entity e : arr) {
 		ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, numUpdates);
 	}
-}
\ No newline at end of file
+}
+
+class ParallelTestSystem : public IComponentSystem<TestComponent1> {
+public:
+	int chunksAtAfterWork = 0;
+	std::atomic<int> chunksDone{ 0 };
+
+	ParallelTestSystem() {
+		parallel = true;
+	}
+
+	virtual void DoWork(double deltaTime, const ComponentDatablock<TestComponent1> &components) override {
+		ComponentDataIterator<TestComponent1> data1 = components.Get<TestComponent1>();
+		for (size_t i = 0; i < components.size(); i++) {
+			data1[i].testValue++;
+		}
+		chunksDone++;
+	}
+
+	void AfterWork(double deltaTime, const WorldAccessor& world) override {
+		chunksAtAfterWork = chunksDone;
+	}
+};
+
+
+TEST(ComponentSystems, Parallel) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+	SystemManager *systemmanager = World::GetSystemManager();
+
+	ParallelTestSystem *system = new ParallelTestSystem();
+	systemmanager->RegisterSystem(system);
+
+	const size_t numents = 100000;
+	const int numUpdates = 10;
+	EntityArray arr = entitymanager->CreateEntities(numents, EntityArchetype::Create<TestComponent1>());
+
+	std::vector<ComponentMemoryBlock*> blocks;
+	size_t numBlocks = componentmanager->GetMemoryBlocks(blocks, ComponentQueryBuilder().Include<TestComponent1>().Build());
+
+	for (int i = 0; i < numUpdates; ++i) {
+		systemmanager->Update(World::GetWorldAccessor(), 1);
+		ASSERT_EQ(system->chunksAtAfterWork, (int)numBlocks * (i + 1));
+	}
+
+	for (Entity e : arr) {
+		ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, numUpdates);
+	}
+}
+
+
+TEST(ThreadPools, ParallelFor) {
+	ThreadPool pool(4);
+
+	const size_t count = 10000;
+	std::vector<int> values(count, 0);
+	pool.ParallelFor(count, 16, [&values](size_t i) {
+		values[i]++;
+	});
+
+	for (int v : values) {
+		ASSERT_EQ(v, 1);
+	}
+
+	//Nested calls must finish even when every worker is waiting on an inner loop
+	std::atomic<size_t> total{ 0 };
+	pool.ParallelFor(64, 1, [&pool, &total](size_t) {
+		pool.ParallelFor(100, 10, [&total](size_t) {
+			total++;
+		});
+	});
+	ASSERT_EQ(total, 64 * 100);
+}
+
+
+class ReadOneSystem : public IComponentSystem<const TestComponent1> {
+public:
+	std::atomic<int64_t> sum{ 0 };
+
+	virtual void DoWork(double deltaTime, const ComponentDatablock<const TestComponent1> &components) override {
+		ComponentDataIterator<const TestComponent1> data1 = components.Get<const TestComponent1>();
+		for (size_t i = 0; i < components.size(); i++) {
+			sum += data1[i].testValue;
+		}
+	}
+};
+
+class ReadBothSystem : public IComponentSystem<const TestComponent1, const TestComponent2> {
+public:
+	virtual void DoWork(double deltaTime, const ComponentDatablock<const TestComponent1, const TestComponent2> &components) override {}
+};
+
+class WriteOneSystem : public IComponentSystem<TestComponent1> {
+public:
+	virtual void DoWork(double deltaTime, const ComponentDatablock<TestComponent1> &components) override {
+		ComponentDataIterator<TestComponent1> data1 = components.Get<TestComponent1>();
+		for (size_t i = 0; i < components.size(); i++) {
+			data1[i].testValue++;
+		}
+	}
+};
+
+class WriteTwoSystem : public IComponentSystem<TestComponent2> {
+public:
+	virtual void DoWork(double deltaTime, const ComponentDatablock<TestComponent2> &components) override {
+		ComponentDataIterator<TestComponent2> data2 = components.Get<TestComponent2>();
+		for (size_t i = 0; i < components.size(); i++) {
+			data2[i].testBigint++;
+		}
+	}
+};
+
+
+TEST(Systems, ParallelScheduling) {
+	World::Setup();
+	EntityManager *entitymanager = World::GetEntityManager();
+	ComponentManager *componentmanager = World::GetComponentManager();
+	SystemManager *systemmanager = World::GetSystemManager();
+
+	const size_t numents = 10000;
+	EntityArray arr = entitymanager->CreateEntities(numents, EntityArchetype::Create<TestComponent1, TestComponent2>());
+
+	ReadOneSystem *reader = new ReadOneSystem();
+	systemmanager->RegisterSystem(reader);
+	systemmanager->RegisterSystem(new ReadBothSystem());
+	systemmanager->RegisterSystem(new WriteOneSystem());
+	systemmanager->RegisterSystem(new WriteTwoSystem());
+
+	systemmanager->SetParallelScheduling(true);
+
+	//Readers share a level, the writers wait for them but not for each other
+	ASSERT_EQ(systemmanager->GetLevelCount(), 2);
+
+	systemmanager->RegisterSystem(new TestISystem1());
+	ASSERT_EQ(systemmanager->GetLevelCount(), 3);
+
+	const int numUpdates = 10;
+	for (int i = 0; i < numUpdates; ++i) {
+		systemmanager->Update(World::GetWorldAccessor(), 1);
+	}
+
+	//Reader runs before the writer in every frame: 0 + 1 + ... + 9 per entity
+	ASSERT_EQ(reader->sum, (int64_t)numents * (numUpdates - 1) * numUpdates / 2);
+	for (Entity e : arr) {
+		ASSERT_EQ(componentmanager->GetComponent<TestComponent1>(e).testValue, numUpdates);
+		ASSERT_EQ(componentmanager->GetComponent<TestComponent2>(e).testBigint, numUpdates);
+	}
+
+	systemmanager->SetParallelScheduling(false);
+	ASSERT_EQ(systemmanager->GetLevelCount(), 5);
+
+	//Clear goes back to running systems in order
+	systemmanager->SetParallelScheduling(true);
+	World::Setup();
+	systemmanager->RegisterSystem(new ReadOneSystem());
+	systemmanager->RegisterSystem(new ReadBothSystem());
+	ASSERT_EQ(systemmanager->GetLevelCount(), 2);
+}
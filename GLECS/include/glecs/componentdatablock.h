@@ -25,6 +25,9 @@ namespace gleng {
 
 	template <typename T>
 	struct ComponentDataIterator<T, typename std::enable_if<std::is_base_of<IComponent<T>, T>::value>::type> {
+		//data is always aligned to this, so kernels may use aligned vector loads on it
+		static constexpr size_t alignment = ComponentMemoryBlock::ColumnAlignment<T>();
+
 		T* data;
 		const size_t len;
 
@@ -55,7 +58,7 @@ namespace gleng {
 
 		inline ComponentDataIterator(ComponentMemoryBlock *block) {
 			CHECK_T_IS_COMPONENT;
-			if (block->type.HasComponentType(IComponent<T>::ComponentTypeID)) {
+			if (block->type.HasComponent<T>()) {
 				len = block->size();
 				data = block->GetComponentArray<T>();
 				isAvailable = true;
@@ -75,7 +78,7 @@ namespace gleng {
 		inline ComponentDataIterator(ComponentMemoryBlock *block) {
 			CHECK_T_IS_SHARED_COMPONENT;
 
-			if (block->type.HasSharedComponentType(ISharedComponent<T>::ComponentTypeID)) {
+			if (block->type.HasSharedComponent<T>()) {
 				component = block->type.GetSharedComponent<T>();
 				isAvailable = true;
 			} else {
@@ -85,7 +88,67 @@ namespace gleng {
 		}
 	};
 
-	//TODO: const iterator. Doesn't mark as dirty
+	//Read-only access. Systems that only take const components can be scheduled next to other readers.
+	template <typename T>
+	struct ComponentDataIterator<const T, typename std::enable_if<std::is_base_of<IComponent<T>, T>::value>::type> {
+		static constexpr size_t alignment = ComponentMemoryBlock::ColumnAlignment<T>();
+
+		const T* data;
+		const size_t len;
+
+		inline ComponentDataIterator(ComponentMemoryBlock *block) : len(block->size()) {
+			CHECK_T_IS_COMPONENT;
+			data = block->GetComponentArray<T>();
+		}
+
+		inline const T* begin() {
+			return data;
+		}
+
+		inline const T* end() {
+			return data + len;
+		}
+
+		inline const T& operator [](size_t index) {
+			assert(index < len);
+			return data[index];
+		}
+	};
+
+	template <typename T>
+	struct ComponentDataIterator<const T, typename std::enable_if<std::is_base_of<ISharedComponent<T>, T>::value>::type> {
+		const T* const component;
+
+		inline ComponentDataIterator(ComponentMemoryBlock *block) : component(block->type.GetSharedComponent<T>()) {
+			CHECK_T_IS_SHARED_COMPONENT;
+		}
+	};
+
+	template <typename T>
+	struct ComponentDataIterator<Optional<const T>, typename std::enable_if<std::is_base_of<IComponent<T>, T>::value>::type> {
+		bool isAvailable;
+		const T* data;
+		size_t len;
+
+		inline ComponentDataIterator(ComponentMemoryBlock *block) {
+			ComponentDataIterator<Optional<T>> it(block);
+			isAvailable = it.isAvailable;
+			data = it.data;
+			len = it.len;
+		}
+	};
+
+	template <typename T>
+	struct ComponentDataIterator<Optional<const T>, typename std::enable_if<std::is_base_of<ISharedComponent<T>, T>::value>::type> {
+		bool isAvailable;
+		const T* component;
+
+		inline ComponentDataIterator(ComponentMemoryBlock *block) {
+			ComponentDataIterator<Optional<T>> it(block);
+			isAvailable = it.isAvailable;
+			component = it.component;
+		}
+	};
 
 
 
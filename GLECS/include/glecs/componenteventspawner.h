@@ -6,8 +6,11 @@ namespace gleng {
 
 
 	struct IComponentEventSpawnerInstance {
+		virtual ~IComponentEventSpawnerInstance() = default;
 		virtual void ComponentAdded(const Entity&, EventManager*) = 0;
 		virtual void ComponentRemoved(const Entity&, EventManager*) = 0;
+		virtual void ComponentsAdded(const Entity*, size_t, EventManager*) = 0;
+		virtual void ComponentsRemoved(const Entity*, size_t, EventManager*) = 0;
 	};
 
 	template <class T>
@@ -24,13 +27,30 @@ namespace gleng {
 			event.entity = e;
 			em->QueueEvent(event);
 		}
+
+		inline void ComponentsAdded(const Entity* entities, size_t count, EventManager* em) {
+			ComponentAddedEvent<T> *events = em->QueueEvents<ComponentAddedEvent<T>>(count);
+			for (size_t i = 0; i < count; ++i) {
+				events[i].entity = entities[i];
+			}
+		}
+
+		inline void ComponentsRemoved(const Entity* entities, size_t count, EventManager* em) {
+			ComponentRemovedEvent<T> *events = em->QueueEvents<ComponentRemovedEvent<T>>(count);
+			for (size_t i = 0; i < count; ++i) {
+				events[i].entity = entities[i];
+			}
+		}
 	};
 
 
 	struct ISharedComponentEventSpawnerInstance {
+		virtual ~ISharedComponentEventSpawnerInstance() = default;
 		virtual void SharedComponentAdded(const Entity&, void*, EventManager*) = 0;
 		virtual void SharedComponentRemoved(const Entity&, void*, EventManager*) = 0;
-};
+		virtual void SharedComponentsAdded(const Entity*, size_t, void*, EventManager*) = 0;
+		virtual void SharedComponentsRemoved(const Entity*, size_t, void*, EventManager*) = 0;
+	};
 
 	template <class T>
 	struct SharedComponentEventSpawnerInstance : public ISharedComponentEventSpawnerInstance {
@@ -48,11 +68,28 @@ namespace gleng {
 			event.component = static_cast<T*>(c);
 			em->QueueEvent(event);
 		}
+
+		inline void SharedComponentsAdded(const Entity* entities, size_t count, void* c, EventManager* em) {
+			SharedComponentAddedEvent<T> *events = em->QueueEvents<SharedComponentAddedEvent<T>>(count);
+			for (size_t i = 0; i < count; ++i) {
+				events[i].entity = entities[i];
+				events[i].component = static_cast<T*>(c);
+			}
+		}
+
+		inline void SharedComponentsRemoved(const Entity* entities, size_t count, void* c, EventManager* em) {
+			SharedComponentRemovedEvent<T> *events = em->QueueEvents<SharedComponentRemovedEvent<T>>(count);
+			for (size_t i = 0; i < count; ++i) {
+				events[i].entity = entities[i];
+				events[i].component = static_cast<T*>(c);
+			}
+		}
 	};
 
 	class ComponentEventSpawner {
 #ifdef ECS_NO_TSL
 		std::unordered_map<type_hash, IComponentEventSpawnerInstance*, util::typehasher> componentEventSpawners;
+		std::unordered_map<type_hash, ISharedComponentEventSpawnerInstance*, util::typehasher> sharedComponentEventSpawners;
 #else
 		tsl::robin_map<type_hash, IComponentEventSpawnerInstance*, util::typehasher> componentEventSpawners;
 		tsl::robin_map<type_hash, ISharedComponentEventSpawnerInstance*, util::typehasher> sharedComponentEventSpawners;
@@ -95,6 +132,21 @@ namespace gleng {
 			}
 		}
 
+		//Batched versions queue one event per entity with a single lookup and virtual call
+		inline void ComponentsAdded(type_hash componentType, const Entity* entities, size_t count, EventManager* em) {
+			auto found = componentEventSpawners.find(componentType);
+			if (found != componentEventSpawners.end()) {
+				found->second->ComponentsAdded(entities, count, em);
+			}
+		}
+
+		inline void ComponentsRemoved(type_hash componentType, const Entity* entities, size_t count, EventManager* em) {
+			auto found = componentEventSpawners.find(componentType);
+			if (found != componentEventSpawners.end()) {
+				found->second->ComponentsRemoved(entities, count, em);
+			}
+		}
+
 		template <class T>
 		inline void ComponentAdded(const Entity& entity, EventManager* em) {
 			CHECK_T_IS_COMPONENT;
@@ -131,6 +183,20 @@ namespace gleng {
 			}
 		}
 
+		inline void SharedComponentsAdded(type_hash componentType, const Entity* entities, size_t count, void* component, EventManager* em) {
+			auto found = sharedComponentEventSpawners.find(componentType);
+			if (found != sharedComponentEventSpawners.end()) {
+				found->second->SharedComponentsAdded(entities, count, component, em);
+			}
+		}
+
+		inline void SharedComponentsRemoved(type_hash componentType, const Entity* entities, size_t count, void* component, EventManager* em) {
+			auto found = sharedComponentEventSpawners.find(componentType);
+			if (found != sharedComponentEventSpawners.end()) {
+				found->second->SharedComponentsRemoved(entities, count, component, em);
+			}
+		}
+
 		template <class T>
 		inline void SharedComponentAdded(const Entity& entity, T* component, EventManager* em) {
 			CHECK_T_IS_SHARED_COMPONENT;
@@ -1,4 +1,7 @@
 #pragma once
+#include <algorithm>
+#include <chrono>
+#include <numeric>
 #include "entity.h"
 #include "component.h"
 #include "entityarchetypes.h"
@@ -15,68 +18,114 @@
 namespace gleng {
 
 
-	//TODO: invalid block index
-	struct ArchetypeBlockIndex {
-		bool valid = false;
-		size_t archetypeIndex = 0;
-		size_t blockIndex = 0;
-		size_t elementIndex = 0;
-
-		static ArchetypeBlockIndex Invalid() {
-			ArchetypeBlockIndex index;
-			index.valid = false;
-			return index;
-		}
+	//Cached structural change from one archetype to another, keyed by the component's registry index.
+	//Shared component add edges are also keyed by the shared component instance.
+	struct ArchetypeEdge {
+		size_t component;
+		void* sharedComponent;
+		size_t archetypeIndex;
 	};
 
+	constexpr size_t ARCHETYPE_INDEX_NONE = SIZE_MAX;
+
 	class EntityArchetypeBlock {
 	public:
 		EntityArchetype archetype;
 		std::vector<ComponentMemoryBlock*> archetypeBlocks;
-		int lastUsedIdx = -1;
+
+		//Indices of blocks that may have room, each listed at most once. Blocks that filled up are dropped lazily.
+		std::vector<size_t> freeBlocks;
+		std::vector<uint8_t> inFreeBlocks;
+
+		//Archetypes reached by adding or removing one component. Small, so a linear scan is enough.
+		std::vector<ArchetypeEdge> addEdges;
+		std::vector<ArchetypeEdge> removeEdges;
+
+		//Next archetype whose hash collides with this one
+		size_t nextWithSameHash = ARCHETYPE_INDEX_NONE;
+
+		//Owning manager's entity map, handed to new memory blocks for constant time entity lookups
+		const std::vector<ArchetypeBlockIndex>* entityMap = nullptr;
 
 		inline EntityArchetypeBlock(EntityArchetype type) {
 			archetype = type;
 		}
 
+		static inline bool FindEdge(const std::vector<ArchetypeEdge> &edges, size_t component, void* sharedComponent, size_t &out_archetypeIndex) {
+			for (const ArchetypeEdge &edge : edges) {
+				if (edge.component == component && edge.sharedComponent == sharedComponent) {
+					out_archetypeIndex = edge.archetypeIndex;
+					return true;
+				}
+			}
+			return false;
+		}
+
 		inline size_t CreateNewBlockIndex() {
 			static MemoryBlockAllocator &allocator = MemoryBlockAllocator::instance();
 
-			ComponentMemoryBlock *newBlock = allocator.Allocate();
+			ComponentMemoryBlock *newBlock = allocator.Allocate(ComponentMemoryBlock::DataSizeFor(archetype));
 
-			newBlock->Initialize(archetype);
+			newBlock->Initialize(archetype, entityMap);
 
 			archetypeBlocks.push_back(newBlock);
+			inFreeBlocks.push_back(0);
 
 			return archetypeBlocks.size() - 1;
 		}
 
 		inline size_t GetOrCreateFreeBlockIndex() {
-			if (lastUsedIdx != -1 && archetypeBlocks[lastUsedIdx]->HasRoom()) {
-				return lastUsedIdx;
-			}
-			for (size_t i = 0; i < archetypeBlocks.size(); i++) {
-				ComponentMemoryBlock* block = archetypeBlocks[i];
-				if (block->HasRoom()) {
-					lastUsedIdx = i;
-					return i;
+			while (!freeBlocks.empty()) {
+				size_t idx = freeBlocks.back();
+				if (archetypeBlocks[idx]->HasRoom()) {
+					return idx;
 				}
+				freeBlocks.pop_back();
+				inFreeBlocks[idx] = 0;
 			}
 			//couldn't find free block
-			lastUsedIdx = CreateNewBlockIndex();
-			return lastUsedIdx;
+			size_t idx = CreateNewBlockIndex();
+			MarkHasRoom(idx);
+			return idx;
+		}
+
+		//Called whenever entities leave a block
+		inline void MarkHasRoom(size_t blockIndex) {
+			if (!inFreeBlocks[blockIndex]) {
+				inFreeBlocks[blockIndex] = 1;
+				freeBlocks.push_back(blockIndex);
+			}
+		}
+
+		inline void RebuildFreeBlocks() {
+			freeBlocks.clear();
+			inFreeBlocks.assign(archetypeBlocks.size(), 0);
+			for (size_t i = archetypeBlocks.size(); i > 0; --i) {
+				if (archetypeBlocks[i - 1]->HasRoom()) {
+					MarkHasRoom(i - 1);
+				}
+			}
 		}
 	};
 
 
 	class ComponentManager {
+		//Versions of dead entity IDs have this bit set, so liveness and staleness are checked with one load
+		static constexpr uint32_t deadVersionBit = 0x80000000u;
+
 		std::vector<EntityArchetypeBlock> _archetypes;
 		std::vector<ArchetypeBlockIndex> _entityMap;
+		std::vector<uint32_t> _entityVersions;
 #ifdef ECS_NO_TSL
 		std::unordered_map<type_hash, size_t, util::typehasher> _archetypeHashIndices;
 #else
 		tsl::robin_map<type_hash, size_t, util::typehasher> _archetypeHashIndices;
 #endif // ECS_NO_TSL
+		std::vector<CachedComponentQuery> _cachedQueries;
+
+		//Archetype the next Compact call starts from
+		size_t _compactCursor = 0;
+		std::vector<size_t> _compactOrder;
 
 		EventManager *_eventmanager;
 
@@ -84,122 +133,329 @@ namespace gleng {
 		inline ArchetypeBlockIndex GetFreeBlockOf(const EntityArchetype& archetype) {
 			ArchetypeBlockIndex newArchIndex;
 			newArchIndex.valid = true;
-
-			auto found = _archetypeHashIndices.find(archetype.ArchetypeHash());
-			if (found == _archetypeHashIndices.end()) {
-				size_t idx = CreateNewArchetypeBlock(archetype);
-				newArchIndex.archetypeIndex = idx;
-			} else {
-				newArchIndex.archetypeIndex = found->second;
-			}
-
+			newArchIndex.archetypeIndex = FindOrCreateArchetypeBlock(archetype);
 			newArchIndex.blockIndex = _archetypes[newArchIndex.archetypeIndex].GetOrCreateFreeBlockIndex();
 
 			return newArchIndex;
 		}
 
+		inline void ReserveEntity(const Entity& e) {
+			ReserveEntityIDs(e.ID);
+		}
+
+		inline void ReserveEntityIDs(uint32_t maxID) {
+			if (_entityMap.size() <= maxID) {
+				_entityMap.resize(maxID + 1);
+				_entityVersions.resize(maxID + 1, deadVersionBit);
+			}
+		}
+
+		inline void MarkEntityDead(const Entity& e) {
+			_entityMap[e.ID] = ArchetypeBlockIndex::Invalid();
+			_entityVersions[e.ID] = ((e.version + 1) & ~deadVersionBit) | deadVersionBit;
+		}
+
 		inline EntityArchetypeBlock& FindArchetypeFor(const Entity &e) {
+			assert(IsEntityValid(e));
 			const ArchetypeBlockIndex& idx = _entityMap[e.ID];
 			assert(idx.valid);
 			return _archetypes[idx.archetypeIndex];
 		}
 
 		inline ComponentMemoryBlock* FindComponentBlockFor(const Entity& e) {
+			assert(IsEntityValid(e));
 			const ArchetypeBlockIndex& idx = _entityMap[e.ID];
 			assert(idx.valid);
 			return _archetypes[idx.archetypeIndex].archetypeBlocks[idx.blockIndex];
 		}
 
 		inline ArchetypeBlockIndex FindBlockIndexFor(const Entity& e) {
+			assert(IsEntityValid(e));
 			return _entityMap[e.ID];
 		}
 
 		inline size_t CreateNewArchetypeBlock(const EntityArchetype& archetype) {
 			_archetypes.push_back(EntityArchetypeBlock(archetype));
 			size_t idx = _archetypes.size() - 1;
-			_archetypeHashIndices.emplace(archetype.ArchetypeHash(), idx);
+			_archetypes[idx].entityMap = &_entityMap;
+
+			auto found = _archetypeHashIndices.find(archetype.ArchetypeHash());
+			if (found != _archetypeHashIndices.end()) {
+				//Hash collision, chain the new archetype in front of the others
+				_archetypes[idx].nextWithSameHash = found->second;
+			}
+			_archetypeHashIndices[archetype.ArchetypeHash()] = idx;
+
+			for (CachedComponentQuery &cached : _cachedQueries) {
+				if (cached.query.Matches(archetype)) {
+					cached.archetypeIndices.push_back(idx);
+				}
+			}
 			return idx;
 		}
 
-		inline size_t ArchetypeAddComponent(const EntityArchetype& archetype, const ComponentType& component) {
-			type_hash newHash = archetype.ArchetypeHash() ^ component.type;
-
-			auto found = _archetypeHashIndices.find(newHash);
+		//The hash only narrows down the candidates, the archetype signatures decide equality
+		inline size_t FindArchetypeBlock(const EntityArchetype& archetype) const {
+			auto found = _archetypeHashIndices.find(archetype.ArchetypeHash());
 			if (found == _archetypeHashIndices.end()) {
-				EntityArchetype newArchetype = archetype.AddComponent(component);
-
-				size_t idx = CreateNewArchetypeBlock(newArchetype);
-				return idx;
-			} else {
-				return found->second;
+				return ARCHETYPE_INDEX_NONE;
+			}
+			for (size_t idx = found->second; idx != ARCHETYPE_INDEX_NONE; idx = _archetypes[idx].nextWithSameHash) {
+				if (_archetypes[idx].archetype == archetype) {
+					return idx;
+				}
 			}
+			return ARCHETYPE_INDEX_NONE;
 		}
 
-		inline size_t ArchetypeRemoveComponent(const EntityArchetype& archetype, const ComponentType& component) {
-			type_hash newHash = archetype.ArchetypeHash() ^ component.type;
+		inline size_t FindOrCreateArchetypeBlock(const EntityArchetype& archetype) {
+			size_t idx = FindArchetypeBlock(archetype);
+			if (idx == ARCHETYPE_INDEX_NONE) {
+				idx = CreateNewArchetypeBlock(archetype);
+			}
+			return idx;
+		}
 
-			auto found = _archetypeHashIndices.find(newHash);
-			if (found == _archetypeHashIndices.end()) {
-				EntityArchetype newArchetype = archetype.RemoveComponent(component);
+		inline void CacheArchetypeEdge(size_t fromIndex, size_t toIndex, size_t component, void* sharedComponent = nullptr) {
+			_archetypes[fromIndex].addEdges.push_back({ component, sharedComponent, toIndex });
+			_archetypes[toIndex].removeEdges.push_back({ component, nullptr, fromIndex });
+		}
 
-				size_t idx = CreateNewArchetypeBlock(newArchetype);
+		inline size_t ArchetypeAddComponent(size_t archetypeIndex, const ComponentType& component) {
+			size_t idx;
+			if (EntityArchetypeBlock::FindEdge(_archetypes[archetypeIndex].addEdges, component.index, nullptr, idx)) {
 				return idx;
-			} else {
-				return found->second;
 			}
-		}
 
-		inline size_t FindOrCreateArchetypeBlock(const EntityArchetype& archetype) {
-			type_hash newHash = archetype.ArchetypeHash();
+			EntityArchetype newArchetype = _archetypes[archetypeIndex].archetype.AddComponent(component);
+			idx = FindOrCreateArchetypeBlock(newArchetype);
 
-			auto found = _archetypeHashIndices.find(newHash);
-			if (found == _archetypeHashIndices.end()) {
-				size_t idx = CreateNewArchetypeBlock(archetype);
+			CacheArchetypeEdge(archetypeIndex, idx, component.index);
+			return idx;
+		}
+
+		inline size_t ArchetypeRemoveComponent(size_t archetypeIndex, const ComponentType& component) {
+			size_t idx;
+			if (EntityArchetypeBlock::FindEdge(_archetypes[archetypeIndex].removeEdges, component.index, nullptr, idx)) {
 				return idx;
-			} else {
-				return found->second;
 			}
+
+			EntityArchetype newArchetype = _archetypes[archetypeIndex].archetype.RemoveComponent(component);
+			idx = FindOrCreateArchetypeBlock(newArchetype);
+
+			CacheArchetypeEdge(idx, archetypeIndex, component.index);
+			return idx;
 		}
 
 		inline ComponentMemoryBlock* GetMemoryBlock(const ArchetypeBlockIndex &idx) {
 			return _archetypes[idx.archetypeIndex].archetypeBlocks[idx.blockIndex];
 		}
 
+		//Removes the entity at idx from its memory block, moving the block's last entity into its place
+		inline void RemoveFromBlock(const ArchetypeBlockIndex &idx) {
+			Entity removedEntity = GetMemoryBlock(idx)->RemoveEntityMoveLast(idx.elementIndex);
+			if (removedEntity.ID != ENTITY_NULL_ID) {
+				_entityMap[removedEntity.ID].elementIndex = idx.elementIndex;
+			}
+			_archetypes[idx.archetypeIndex].MarkHasRoom(idx.blockIndex);
+		}
+
 		inline const EntityArchetype& GetArchetype(const ArchetypeBlockIndex &idx) {
 			return _archetypes[idx.archetypeIndex].archetype;
 		}
 
 		template<class T>
-		inline size_t ArchetypeAddSharedComponent(const EntityArchetype& archetype, T* component) {
+		inline size_t ArchetypeAddSharedComponent(size_t archetypeIndex, T* component) {
 			CHECK_T_IS_SHARED_COMPONENT;
+			size_t type = util::GetComponentIndex<T>();
 
-			static std::hash<void*> hasher;
-			type_hash newHash = archetype.ArchetypeHash() ^ ISharedComponent<T>::ComponentTypeID ^ hasher(component);
-
-			auto found = _archetypeHashIndices.find(newHash);
-			if (found == _archetypeHashIndices.end()) {
-				EntityArchetype newArchetype = archetype.AddSharedComponent(component);
-
-				size_t idx = CreateNewArchetypeBlock(newArchetype);
+			size_t idx;
+			if (EntityArchetypeBlock::FindEdge(_archetypes[archetypeIndex].addEdges, type, component, idx)) {
 				return idx;
-			} else {
-				return found->second;
 			}
+
+			EntityArchetype newArchetype = _archetypes[archetypeIndex].archetype.AddSharedComponent(component);
+			idx = FindOrCreateArchetypeBlock(newArchetype);
+
+			CacheArchetypeEdge(archetypeIndex, idx, type, component);
+			return idx;
 		}
 
 		template<class T>
-		inline size_t ArchetypeRemoveSharedComponent(const EntityArchetype& archetype) {
+		inline size_t ArchetypeRemoveSharedComponent(size_t archetypeIndex) {
 			CHECK_T_IS_SHARED_COMPONENT;
-			EntityArchetype newArchetype = archetype.RemoveSharedComponent(ISharedComponent<T>::ComponentTypeID);
-			type_hash newHash = newArchetype.ArchetypeHash();
+			size_t type = util::GetComponentIndex<T>();
 
-			auto found = _archetypeHashIndices.find(newHash);
-			if (found == _archetypeHashIndices.end()) {
-				size_t idx = CreateNewArchetypeBlock(newArchetype);
+			size_t idx;
+			if (EntityArchetypeBlock::FindEdge(_archetypes[archetypeIndex].removeEdges, type, nullptr, idx)) {
 				return idx;
-			} else {
-				return found->second;
 			}
+
+			T* component = _archetypes[archetypeIndex].archetype.GetSharedComponent<T>();
+			EntityArchetype newArchetype = _archetypes[archetypeIndex].archetype.RemoveSharedComponent(ISharedComponent<T>::ComponentTypeID);
+			idx = FindOrCreateArchetypeBlock(newArchetype);
+
+			CacheArchetypeEdge(idx, archetypeIndex, type, component);
+			return idx;
+		}
+
+		//Moves the entity without queuing events and returns the index of the archetype it left
+		inline size_t MoveEntityToArchetypeIndex(const Entity &e, size_t archetypeIndex) {
+			ArchetypeBlockIndex oldBlock = FindBlockIndexFor(e);
+
+			ArchetypeBlockIndex newBlock;
+
+			assert(oldBlock.valid);
+			if (oldBlock.archetypeIndex == archetypeIndex) {
+				return archetypeIndex; //already there
+			}
+
+			newBlock.valid = true;
+			newBlock.archetypeIndex = archetypeIndex;
+
+			newBlock.blockIndex = _archetypes[newBlock.archetypeIndex].GetOrCreateFreeBlockIndex();
+			auto ob = GetMemoryBlock(oldBlock);
+			auto nb = GetMemoryBlock(newBlock);
+
+			newBlock.elementIndex = ob->CopyEntityTo(oldBlock.elementIndex, e, nb);
+			RemoveFromBlock(oldBlock);
+			_entityMap[e.ID] = newBlock;
+			return oldBlock.archetypeIndex;
+		}
+
+		inline void MoveToArchetypeIndex(const Entity &e, size_t archetypeIndex) {
+			size_t oldArchetypeIndex = MoveEntityToArchetypeIndex(e, archetypeIndex);
+			if (oldArchetypeIndex == archetypeIndex) {
+				return;
+			}
+
+#ifndef ECS_NO_COMPONENT_EVENTS
+			QueueArchetypeChangeEvents(&_archetypes[oldArchetypeIndex].archetype, &_archetypes[archetypeIndex].archetype, &e, 1);
+#endif //ECS_NO_COMPONENT_EVENTS
+		}
+
+#ifndef ECS_NO_COMPONENT_EVENTS
+		/*
+		Queues added and removed events for a range of entities that all moved from one archetype to another.
+		Each event type gets the whole range in one go. Pass nullptr as from for created entities and as to for destroyed ones.
+		*/
+		inline void QueueArchetypeChangeEvents(const EntityArchetype* from, const EntityArchetype* to, const Entity* entities, size_t count) {
+			ComponentEventSpawner &spawner = ComponentEventSpawner::instance();
+
+			if (from != nullptr) {
+				for (const ComponentType &oldC : from->GetComponentTypes()) {
+					if (to == nullptr || !to->HasComponentIndex(oldC.index)) {
+						spawner.ComponentsRemoved(oldC.type, entities, count, _eventmanager);
+					}
+				}
+			}
+
+			if (to != nullptr) {
+				for (const ComponentType &newC : to->GetComponentTypes()) {
+					if (from == nullptr || !from->HasComponentIndex(newC.index)) {
+						spawner.ComponentsAdded(newC.type, entities, count, _eventmanager);
+					}
+				}
+			}
+
+			if (from != nullptr) {
+				for (auto oldC : from->GetSharedComponents()) {
+					if (to == nullptr || !to->HasSharedComponentType(oldC.first)) {
+						spawner.SharedComponentsRemoved(oldC.first, entities, count, oldC.second, _eventmanager);
+					}
+				}
+			}
+
+			if (to != nullptr) {
+				for (auto newC : to->GetSharedComponents()) {
+					if (from == nullptr || !from->HasSharedComponentType(newC.first)) {
+						spawner.SharedComponentsAdded(newC.first, entities, count, newC.second, _eventmanager);
+					}
+				}
+			}
+		}
+#endif //ECS_NO_COMPONENT_EVENTS
+
+		/*
+		Packs an archetype's entities into as few memory blocks as possible and frees the emptied blocks.
+		The deadline is checked after each emptied source block, at least one is always emptied.
+		Returns false if the deadline stopped it early, calling it again continues the work.
+		*/
+		inline bool CompactArchetype(size_t archetypeIndex, std::chrono::steady_clock::time_point deadline) {
+			EntityArchetypeBlock &atype = _archetypes[archetypeIndex];
+			std::vector<ComponentMemoryBlock*> &blocks = atype.archetypeBlocks;
+			if (blocks.empty()) {
+				return true;
+			}
+
+			bool finished = true;
+
+			size_t total = 0;
+			size_t numEmpty = 0;
+			for (ComponentMemoryBlock *block : blocks) {
+				total += block->size();
+				numEmpty += block->size() == 0;
+			}
+			size_t capacity = blocks[0]->maxSize();
+			size_t needed = (total + capacity - 1) / capacity;
+
+			if (blocks.size() - numEmpty > needed) {
+				//Fill the fullest blocks with entities from the emptiest ones
+				_compactOrder.resize(blocks.size());
+				std::iota(_compactOrder.begin(), _compactOrder.end(), 0);
+				std::sort(_compactOrder.begin(), _compactOrder.end(), [&blocks](size_t a, size_t b) {
+					return blocks[a]->size() > blocks[b]->size();
+				});
+
+				size_t dst = 0;
+				size_t src = _compactOrder.size() - 1;
+				while (dst < src) {
+					ComponentMemoryBlock *to = blocks[_compactOrder[dst]];
+					ComponentMemoryBlock *from = blocks[_compactOrder[src]];
+					if (!to->HasRoom()) {
+						++dst;
+						continue;
+					}
+					if (from->size() == 0) {
+						--src;
+						if (dst < src && std::chrono::steady_clock::now() >= deadline) {
+							finished = false;
+							break;
+						}
+						continue;
+					}
+
+					size_t count = std::min(from->size(), to->maxSize() - to->size());
+					size_t newIdx = from->MoveLastEntitiesTo(count, to);
+					const Entity* entArr = to->GetEntityArray();
+					for (size_t i = newIdx; i < newIdx + count; ++i) {
+						ArchetypeBlockIndex &idx = _entityMap[entArr[i].ID];
+						idx.blockIndex = _compactOrder[dst];
+						idx.elementIndex = i;
+					}
+				}
+			}
+
+			//Free the empty blocks, keeping the order of the others
+			size_t kept = 0;
+			for (size_t b = 0; b < blocks.size(); ++b) {
+				ComponentMemoryBlock *block = blocks[b];
+				if (block->size() == 0) {
+					MemoryBlockAllocator::instance().Deallocate(block);
+					continue;
+				}
+				if (kept != b) {
+					blocks[kept] = block;
+					const Entity* entArr = block->GetEntityArray();
+					for (size_t i = 0; i < block->size(); ++i) {
+						_entityMap[entArr[i].ID].blockIndex = kept;
+					}
+				}
+				++kept;
+			}
+			blocks.resize(kept);
+			atype.RebuildFreeBlocks();
+			return finished;
 		}
 
 	public:
@@ -211,30 +467,62 @@ namespace gleng {
 		inline void AddEntity(const Entity& e) {
 			static const EntityArchetype empty;
 
-			if (_entityMap.size() <= e.ID) {
-				_entityMap.resize(e.ID + 1);
-			}
+			ReserveEntity(e);
 			ArchetypeBlockIndex idx = GetFreeBlockOf(empty);
 			idx.elementIndex = _archetypes[idx.archetypeIndex].archetypeBlocks[idx.blockIndex]->AddEntity(e);
 			_entityMap[e.ID] = idx;
+			_entityVersions[e.ID] = e.version;
 		}
 
 		inline void AddEntity(const Entity& e, const EntityArchetype& archetype) {
-			if (_entityMap.size() <= e.ID) {
-				_entityMap.resize(e.ID + 1);
-			}
+			ReserveEntity(e);
 			ArchetypeBlockIndex idx = GetFreeBlockOf(archetype);
 			idx.elementIndex = _archetypes[idx.archetypeIndex].archetypeBlocks[idx.blockIndex]->AddEntity(e);
 			_entityMap[e.ID] = idx;
+			_entityVersions[e.ID] = e.version;
 
 #ifndef ECS_NO_COMPONENT_EVENTS
-			for (std::pair<type_hash, size_t> component : _archetypes[idx.archetypeIndex].archetype.GetComponentTypes()) {
-				ComponentEventSpawner::instance().ComponentAdded(component.first, e, _eventmanager);
+			QueueArchetypeChangeEvents(nullptr, &_archetypes[idx.archetypeIndex].archetype, &e, 1);
+#endif //ECS_NO_COMPONENT_EVENTS
+		}
+
+		//Adds count entities of the same archetype, filling each memory block with a contiguous range
+		inline void AddEntities(const Entity* entities, size_t count, const EntityArchetype& archetype) {
+			if (count == 0) {
+				return;
 			}
 
-			for (std::pair<type_hash, void*> sharedComponent : _archetypes[idx.archetypeIndex].archetype.GetSharedComponents()) {
-				ComponentEventSpawner::instance().SharedComponentAdded(sharedComponent.first, e, sharedComponent.second, _eventmanager);
+			uint32_t maxID = 0;
+			for (size_t i = 0; i < count; ++i) {
+				assert(entities[i].ID != ENTITY_NULL_ID);
+				maxID = std::max(maxID, entities[i].ID);
+			}
+			ReserveEntityIDs(maxID);
+
+			ArchetypeBlockIndex idx;
+			idx.valid = true;
+			idx.archetypeIndex = FindOrCreateArchetypeBlock(archetype);
+			EntityArchetypeBlock &atype = _archetypes[idx.archetypeIndex];
+
+			size_t added = 0;
+			while (added < count) {
+				idx.blockIndex = atype.GetOrCreateFreeBlockIndex();
+				ComponentMemoryBlock *block = atype.archetypeBlocks[idx.blockIndex];
+
+				size_t num = std::min(block->maxSize() - block->size(), count - added);
+				size_t first = block->AddEntities(entities + added, num);
+
+				for (size_t i = 0; i < num; ++i) {
+					const Entity &e = entities[added + i];
+					idx.elementIndex = first + i;
+					_entityMap[e.ID] = idx;
+					_entityVersions[e.ID] = e.version;
+				}
+				added += num;
 			}
+
+#ifndef ECS_NO_COMPONENT_EVENTS
+			QueueArchetypeChangeEvents(nullptr, &atype.archetype, entities, count);
 #endif //ECS_NO_COMPONENT_EVENTS
 		}
 
@@ -242,29 +530,88 @@ namespace gleng {
 			ArchetypeBlockIndex idx = FindBlockIndexFor(e);
 
 #ifndef ECS_NO_COMPONENT_EVENTS
-			for (std::pair<type_hash, size_t> component : _archetypes[idx.archetypeIndex].archetype.GetComponentTypes()) {
-				ComponentEventSpawner::instance().ComponentRemoved(component.first, e, _eventmanager);
+			QueueArchetypeChangeEvents(&_archetypes[idx.archetypeIndex].archetype, nullptr, &e, 1);
+#endif //ECS_NO_COMPONENT_EVENTS
+
+			RemoveFromBlock(idx);
+
+			MarkEntityDead(e);
+		}
+
+		//Removes count entities at once. Victims are grouped by memory block and each block is compacted once.
+		inline void RemoveEntities(const Entity* entities, size_t count) {
+			if (count == 0) {
+				return;
+			}
+
+			std::vector<ArchetypeBlockIndex> victims;
+			victims.reserve(count);
+			for (size_t i = 0; i < count; ++i) {
+				victims.push_back(FindBlockIndexFor(entities[i]));
 			}
 
-			for (std::pair<type_hash, void*> sharedComponent : _archetypes[idx.archetypeIndex].archetype.GetSharedComponents()) {
-				ComponentEventSpawner::instance().SharedComponentRemoved(sharedComponent.first, e, sharedComponent.second, _eventmanager);
+#ifndef ECS_NO_COMPONENT_EVENTS
+			//one batch per run of entities sharing an archetype, keeping the events in the given order
+			for (size_t first = 0; first < count;) {
+				size_t archetypeIndex = victims[first].archetypeIndex;
+				size_t last = first + 1;
+				while (last < count && victims[last].archetypeIndex == archetypeIndex) {
+					++last;
+				}
+				QueueArchetypeChangeEvents(&_archetypes[archetypeIndex].archetype, nullptr, entities + first, last - first);
+				first = last;
 			}
 #endif //ECS_NO_COMPONENT_EVENTS
 
-			Entity removedEntity = _archetypes[idx.archetypeIndex].archetypeBlocks[idx.blockIndex]->RemoveEntityMoveLast(idx.elementIndex);
-			if (removedEntity.ID != ENTITY_NULL_ID) {
-				_entityMap[removedEntity.ID].elementIndex = idx.elementIndex;
+			for (size_t i = 0; i < count; ++i) {
+				MarkEntityDead(entities[i]);
 			}
 
-			_entityMap[e.ID] = ArchetypeBlockIndex::Invalid();
+			std::sort(victims.begin(), victims.end(), [](const ArchetypeBlockIndex& a, const ArchetypeBlockIndex& b) {
+				if (a.archetypeIndex != b.archetypeIndex) return a.archetypeIndex < b.archetypeIndex;
+				if (a.blockIndex != b.blockIndex) return a.blockIndex < b.blockIndex;
+				return a.elementIndex < b.elementIndex;
+			});
+
+			std::vector<size_t> indices;
+			std::vector<size_t> moved;
+			size_t groupStart = 0;
+			while (groupStart < victims.size()) {
+				const ArchetypeBlockIndex &group = victims[groupStart];
+				indices.clear();
+				size_t groupEnd = groupStart;
+				while (groupEnd < victims.size()
+					&& victims[groupEnd].archetypeIndex == group.archetypeIndex
+					&& victims[groupEnd].blockIndex == group.blockIndex) {
+					assert(indices.empty() || indices.back() != victims[groupEnd].elementIndex); //same entity twice
+					indices.push_back(victims[groupEnd].elementIndex);
+					++groupEnd;
+				}
+
+				ComponentMemoryBlock *block = GetMemoryBlock(group);
+				moved.clear();
+				block->RemoveEntities(indices.data(), indices.size(), moved);
+
+				Entity *entArr = block->GetEntityArray();
+				for (size_t newIdx : moved) {
+					_entityMap[entArr[newIdx].ID].elementIndex = newIdx;
+				}
+				_archetypes[group.archetypeIndex].MarkHasRoom(group.blockIndex);
+
+				groupStart = groupEnd;
+			}
 		}
 
-		inline bool IsEntityValid(const Entity& e) {
-			if (e.ID < _entityMap.size()) {
-				ArchetypeBlockIndex idx = FindBlockIndexFor(e);
-				return idx.valid;
+		inline bool IsEntityValid(const Entity& e) const {
+			return e.ID < _entityVersions.size() && _entityVersions[e.ID] == e.version;
+		}
+
+		//Returns the version the next entity created with this ID should have
+		inline uint32_t GetEntityVersion(uint32_t id) const {
+			if (id < _entityVersions.size()) {
+				return _entityVersions[id] & ~deadVersionBit;
 			} else {
-				return false;
+				return 0;
 			}
 		}
 
@@ -287,7 +634,7 @@ namespace gleng {
 
 			newBlock.valid = true;
 			newBlock.archetypeIndex = ArchetypeAddComponent(
-				GetArchetype(oldBlock),
+				oldBlock.archetypeIndex,
 				ComponentType::Get<T>());
 
 			newBlock.blockIndex = _archetypes[newBlock.archetypeIndex].GetOrCreateFreeBlockIndex();
@@ -296,10 +643,7 @@ namespace gleng {
 			auto nb = GetMemoryBlock(newBlock);
 			newBlock.elementIndex = ob->CopyEntityTo(oldBlock.elementIndex, e, nb);
 
-			Entity removedEntity = ob->RemoveEntityMoveLast(oldBlock.elementIndex);
-			if (removedEntity.ID != ENTITY_NULL_ID) {
-				_entityMap[removedEntity.ID].elementIndex = oldBlock.elementIndex;
-			}
+			RemoveFromBlock(oldBlock);
 
 			_entityMap[e.ID] = newBlock;
 
@@ -325,7 +669,7 @@ namespace gleng {
 
 			newBlock.valid = true;
 			newBlock.archetypeIndex = ArchetypeRemoveComponent(
-				GetArchetype(oldBlock),
+				oldBlock.archetypeIndex,
 				ComponentType::Get<T>());
 
 			newBlock.blockIndex = _archetypes[newBlock.archetypeIndex].GetOrCreateFreeBlockIndex();
@@ -333,10 +677,7 @@ namespace gleng {
 			auto nb = GetMemoryBlock(newBlock);
 			newBlock.elementIndex = ob->CopyEntityTo(oldBlock.elementIndex, e, nb);
 
-			Entity removedEntity = ob->RemoveEntityMoveLast(oldBlock.elementIndex);
-			if (removedEntity.ID != ENTITY_NULL_ID) {
-				_entityMap[removedEntity.ID].elementIndex = oldBlock.elementIndex;
-			}
+			RemoveFromBlock(oldBlock);
 			_entityMap[e.ID] = newBlock;
 
 #ifndef ECS_NO_COMPONENT_EVENTS
@@ -345,59 +686,97 @@ namespace gleng {
 		}
 
 		inline void MoveToArchetype(const Entity &e, const EntityArchetype& archetype) {
-			ArchetypeBlockIndex oldBlock = FindBlockIndexFor(e);
-
-			ArchetypeBlockIndex newBlock;
-
-			assert(oldBlock.valid);
-
-			newBlock.valid = true;
-			newBlock.archetypeIndex = FindOrCreateArchetypeBlock(archetype);
-
-			newBlock.blockIndex = _archetypes[newBlock.archetypeIndex].GetOrCreateFreeBlockIndex();
-			auto ob = GetMemoryBlock(oldBlock);
-			auto nb = GetMemoryBlock(newBlock);
+			MoveToArchetypeIndex(e, FindOrCreateArchetypeBlock(archetype));
+		}
 
-			newBlock.elementIndex = ob->CopyEntityTo(oldBlock.elementIndex, e, nb);
-			Entity removedEntity = ob->RemoveEntityMoveLast(oldBlock.elementIndex);
-			if (removedEntity.ID != ENTITY_NULL_ID) {
-				_entityMap[removedEntity.ID].elementIndex = oldBlock.elementIndex;
+		/*
+		Moves count entities to the same archetype, which is looked up only once.
+		Entities already in it are skipped. The rest are grouped by the memory block they leave,
+		and each of those blocks is compacted once after its entities have been copied out.
+		*/
+		inline void MoveToArchetype(const Entity* entities, size_t count, const EntityArchetype& archetype) {
+			if (count == 0) {
+				return;
+			}
+			size_t archetypeIndex = FindOrCreateArchetypeBlock(archetype);
+
+			std::vector<std::pair<ArchetypeBlockIndex, Entity>> movers;
+			movers.reserve(count);
+			for (size_t i = 0; i < count; ++i) {
+				ArchetypeBlockIndex idx = FindBlockIndexFor(entities[i]);
+				assert(idx.valid);
+				if (idx.archetypeIndex != archetypeIndex) {
+					movers.emplace_back(idx, entities[i]);
+				}
+			}
+			if (movers.empty()) {
+				return;
 			}
-			_entityMap[e.ID] = newBlock;
-
 
 #ifndef ECS_NO_COMPONENT_EVENTS
-
-			auto &oldComponents = _archetypes[oldBlock.archetypeIndex].archetype.GetComponentTypes();
-			auto &newComponents = _archetypes[newBlock.archetypeIndex].archetype.GetComponentTypes();
-
-			for (auto oldC : oldComponents) {
-				if (newComponents.find(oldC.first) == newComponents.end()) {
-					ComponentEventSpawner::instance().ComponentRemoved(oldC.first, e, _eventmanager);
+			//events are queued once per run of entities that came from the same archetype, keeping the given order
+			std::vector<Entity> run;
+			size_t runArchetype = movers[0].first.archetypeIndex;
+			for (const auto &mover : movers) {
+				if (mover.first.archetypeIndex != runArchetype) {
+					QueueArchetypeChangeEvents(&_archetypes[runArchetype].archetype, &_archetypes[archetypeIndex].archetype, run.data(), run.size());
+					run.clear();
+					runArchetype = mover.first.archetypeIndex;
 				}
+				run.push_back(mover.second);
 			}
+			QueueArchetypeChangeEvents(&_archetypes[runArchetype].archetype, &_archetypes[archetypeIndex].archetype, run.data(), run.size());
+#endif //ECS_NO_COMPONENT_EVENTS
 
-			for (auto newC : newComponents) {
-				if (oldComponents.find(newC.first) == oldComponents.end()) {
-					ComponentEventSpawner::instance().ComponentAdded(newC.first, e, _eventmanager);
+			std::sort(movers.begin(), movers.end(), [](const std::pair<ArchetypeBlockIndex, Entity>& a, const std::pair<ArchetypeBlockIndex, Entity>& b) {
+				if (a.first.archetypeIndex != b.first.archetypeIndex) return a.first.archetypeIndex < b.first.archetypeIndex;
+				if (a.first.blockIndex != b.first.blockIndex) return a.first.blockIndex < b.first.blockIndex;
+				return a.first.elementIndex < b.first.elementIndex;
+			});
+
+			EntityArchetypeBlock &target = _archetypes[archetypeIndex];
+			std::vector<size_t> indices;
+			std::vector<size_t> moved;
+			size_t groupStart = 0;
+			while (groupStart < movers.size()) {
+				const ArchetypeBlockIndex &group = movers[groupStart].first;
+				ComponentMemoryBlock *block = GetMemoryBlock(group);
+				indices.clear();
+				size_t groupEnd = groupStart;
+				while (groupEnd < movers.size()
+					&& movers[groupEnd].first.archetypeIndex == group.archetypeIndex
+					&& movers[groupEnd].first.blockIndex == group.blockIndex) {
+					const ArchetypeBlockIndex &oldBlock = movers[groupEnd].first;
+					const Entity &e = movers[groupEnd].second;
+					assert(indices.empty() || indices.back() != oldBlock.elementIndex); //same entity twice
+
+					ArchetypeBlockIndex newBlock;
+					newBlock.valid = true;
+					newBlock.archetypeIndex = archetypeIndex;
+					newBlock.blockIndex = target.GetOrCreateFreeBlockIndex();
+					newBlock.elementIndex = block->CopyEntityTo(oldBlock.elementIndex, e, GetMemoryBlock(newBlock));
+					_entityMap[e.ID] = newBlock;
+
+					indices.push_back(oldBlock.elementIndex);
+					++groupEnd;
 				}
-			}
 
+				moved.clear();
+				block->RemoveEntities(indices.data(), indices.size(), moved);
 
-			auto &oldSharedComponents = _archetypes[oldBlock.archetypeIndex].archetype.GetSharedComponents();
-			auto &newSharedComponents = _archetypes[newBlock.archetypeIndex].archetype.GetSharedComponents();
-			for (auto oldC : oldSharedComponents) {
-				if (newSharedComponents.find(oldC.first) == newSharedComponents.end()) {
-					ComponentEventSpawner::instance().SharedComponentRemoved(oldC.first, e, oldC.second, _eventmanager);
+				Entity *entArr = block->GetEntityArray();
+				for (size_t newIdx : moved) {
+					_entityMap[entArr[newIdx].ID].elementIndex = newIdx;
 				}
-			}
+				_archetypes[group.archetypeIndex].MarkHasRoom(group.blockIndex);
 
-			for (auto newC : newSharedComponents) {
-				if (oldSharedComponents.find(newC.first) == oldSharedComponents.end()) {
-					ComponentEventSpawner::instance().SharedComponentAdded(newC.first, e, newC.second, _eventmanager);
-				}
+				groupStart = groupEnd;
 			}
-#endif //ECS_NO_COMPONENT_EVENTS
+		}
+
+
+		inline const EntityArchetype& GetEntityArchetype(const Entity& e) {
+			return FindArchetypeFor(e).archetype;
 		}
 
 		template<class T>
@@ -413,12 +792,21 @@ namespace gleng {
 				->GetComponent<T>(index.elementIndex);
 		}
 
+		//Gives e's component a fresh value, the same one AddComponent would. Used by command buffer playback.
+		inline void ResetComponent(const Entity& e, size_t componentIndex) {
+			ArchetypeBlockIndex index = FindBlockIndexFor(e);
+
+			assert(index.valid);
+
+			GetMemoryBlock(index)->ResetComponent(index.elementIndex, componentIndex);
+		}
+
 		template<class T>
 		inline bool HasComponent(const Entity & e) {
 			CHECK_T_IS_COMPONENT;
 			if (e.ID == ENTITY_NULL_ID) return false;
 
-			return FindArchetypeFor(e).archetype.HasComponentType(IComponent<T>::ComponentTypeID);
+			return FindArchetypeFor(e).archetype.HasComponent<T>();
 		}
 
 
@@ -430,6 +818,15 @@ namespace gleng {
 			return allocator.Allocate<T>();
 		}
 
+		//Returns the shared instance with this value, so equal values end up in the same archetype.
+		//T needs operator==, and a std::hash<T> specialization to scale past a handful of values.
+		template<class T>
+		inline T* GetOrCreateSharedComponent(const T& value) {
+			CHECK_T_IS_SHARED_COMPONENT;
+			static SharedComponentAllocator &allocator = SharedComponentAllocator::instance();
+			return allocator.Intern<T>(value);
+		}
+
 		template<class T>
 		inline void DestroySharedComponent(T* component) {
 			CHECK_T_IS_SHARED_COMPONENT;
@@ -450,7 +847,7 @@ namespace gleng {
 
 			newBlock.valid = true;
 
-			newBlock.archetypeIndex = ArchetypeAddSharedComponent(GetArchetype(oldBlock), component);
+			newBlock.archetypeIndex = ArchetypeAddSharedComponent(oldBlock.archetypeIndex, component);
 
 			newBlock.blockIndex = _archetypes[newBlock.archetypeIndex].GetOrCreateFreeBlockIndex();
 
@@ -458,10 +855,7 @@ namespace gleng {
 			auto nb = GetMemoryBlock(newBlock);
 			newBlock.elementIndex = ob->CopyEntityTo(oldBlock.elementIndex, e, nb);
 
-			Entity removedEntity = ob->RemoveEntityMoveLast(oldBlock.elementIndex);
-			if (removedEntity.ID != ENTITY_NULL_ID) {
-				_entityMap[removedEntity.ID].elementIndex = oldBlock.elementIndex;
-			}
+			RemoveFromBlock(oldBlock);
 
 #ifndef ECS_NO_COMPONENT_EVENTS
 			ComponentEventSpawner::instance().SharedComponentAdded<T>(e, component, _eventmanager);
@@ -483,7 +877,7 @@ namespace gleng {
 
 			newBlock.valid = true;
 
-			newBlock.archetypeIndex = ArchetypeRemoveSharedComponent<T>(GetArchetype(oldBlock));
+			newBlock.archetypeIndex = ArchetypeRemoveSharedComponent<T>(oldBlock.archetypeIndex);
 
 			newBlock.blockIndex = _archetypes[newBlock.archetypeIndex].GetOrCreateFreeBlockIndex();
 
@@ -491,10 +885,7 @@ namespace gleng {
 			auto nb = GetMemoryBlock(newBlock);
 			newBlock.elementIndex = ob->CopyEntityTo(oldBlock.elementIndex, e, nb);
 
-			Entity removedEntity = ob->RemoveEntityMoveLast(oldBlock.elementIndex);
-			if (removedEntity.ID != ENTITY_NULL_ID) {
-				_entityMap[removedEntity.ID].elementIndex = oldBlock.elementIndex;
-			}
+			RemoveFromBlock(oldBlock);
 
 #ifndef ECS_NO_COMPONENT_EVENTS
 			ComponentEventSpawner::instance().SharedComponentRemoved<T>(e, GetArchetype(oldBlock).GetSharedComponent<T>(), _eventmanager);
@@ -514,7 +905,7 @@ namespace gleng {
 		template<class T>
 		inline bool HasSharedComponent(const Entity &e) {
 			CHECK_T_IS_SHARED_COMPONENT;
-			return FindArchetypeFor(e).archetype.HasSharedComponentType(ISharedComponent<T>::ComponentTypeID);
+			return FindArchetypeFor(e).archetype.HasSharedComponent<T>();
 		}
 
 		inline size_t GetMemoryBlocks(std::vector<ComponentMemoryBlock*> &out_memblocks, const ComponentQuery &query) const{
@@ -522,7 +913,9 @@ namespace gleng {
 			for (const EntityArchetypeBlock &atype : _archetypes) {
 				if (query.Matches(atype.archetype)) {
 					for (ComponentMemoryBlock *block : atype.archetypeBlocks) {
-						out_memblocks.push_back(block);
+						if (block->size() > 0) {
+							out_memblocks.push_back(block);
+						}
 					}
 				}
 			}
@@ -535,6 +928,60 @@ namespace gleng {
 			for (const EntityArchetypeBlock &atype : _archetypes) {
 				if (query.Matches(atype.archetype)) {
 					for (ComponentMemoryBlock *block : atype.archetypeBlocks) {
+						if (block->size() > 0) {
+							out_datablocks.emplace_back(block);
+						}
+					}
+				}
+			}
+			return out_datablocks.size();
+		}
+
+		/*
+		Registers a query whose matching archetypes are cached and kept up to date as new archetypes are created.
+		Registering an equal query again returns the same id. Ids stay valid through Clear.
+		*/
+		inline query_id RegisterQuery(const ComponentQuery &query) {
+			for (query_id id = 0; id < _cachedQueries.size(); ++id) {
+				if (_cachedQueries[id].query == query) {
+					return id;
+				}
+			}
+
+			CachedComponentQuery cached;
+			cached.query = query;
+			for (size_t idx = 0; idx < _archetypes.size(); ++idx) {
+				if (query.Matches(_archetypes[idx].archetype)) {
+					cached.archetypeIndices.push_back(idx);
+				}
+			}
+			_cachedQueries.push_back(std::move(cached));
+			return _cachedQueries.size() - 1;
+		}
+
+		inline const std::vector<size_t>& GetMatchingArchetypes(query_id query) const {
+			assert(query < _cachedQueries.size());
+			return _cachedQueries[query].archetypeIndices;
+		}
+
+		inline size_t GetMemoryBlocks(std::vector<ComponentMemoryBlock*> &out_memblocks, query_id query) const {
+			out_memblocks.clear();
+			for (size_t idx : GetMatchingArchetypes(query)) {
+				for (ComponentMemoryBlock *block : _archetypes[idx].archetypeBlocks) {
+					if (block->size() > 0) {
+						out_memblocks.push_back(block);
+					}
+				}
+			}
+			return out_memblocks.size();
+		}
+
+		template <class ...Components>
+		inline size_t GetComponentDataBlocks(std::vector<ComponentDatablock<Components...>> &out_datablocks, query_id query) const {
+			out_datablocks.clear();
+			for (size_t idx : GetMatchingArchetypes(query)) {
+				for (ComponentMemoryBlock *block : _archetypes[idx].archetypeBlocks) {
+					if (block->size() > 0) {
 						out_datablocks.emplace_back(block);
 					}
 				}
@@ -542,10 +989,51 @@ namespace gleng {
 			return out_datablocks.size();
 		}
 
+		inline size_t GetArchetypeCount() const {
+			return _archetypes.size();
+		}
+
+		/*
+		Incremental memory compaction, meant to be called between frames.
+		Moves entities out of sparse memory blocks into fuller blocks of the same archetype and returns
+		the emptied blocks to the allocator. Works until budget is used up, checking it after every emptied
+		block, and the next call continues where this one stopped. Every call makes some progress.
+		Returns true if a full pass finished during this call.
+		The freed blocks keep their memory. Call MemoryBlockAllocator::ReleaseFreeMemory after a pass to give
+		it back to the OS, it walks every block of the allocator so it isn't part of the budgeted work.
+		*/
+		inline bool Compact(std::chrono::nanoseconds budget) {
+			auto deadline = std::chrono::steady_clock::now() + budget;
+			while (_compactCursor < _archetypes.size()) {
+				if (!CompactArchetype(_compactCursor, deadline)) {
+					return false;
+				}
+				++_compactCursor;
+				if (_compactCursor < _archetypes.size() && std::chrono::steady_clock::now() >= deadline) {
+					return false;
+				}
+			}
+			_compactCursor = 0;
+			return true;
+		}
+
+		inline size_t GetMemoryBlockCount() const {
+			size_t count = 0;
+			for (const EntityArchetypeBlock &atype : _archetypes) {
+				count += atype.archetypeBlocks.size();
+			}
+			return count;
+		}
+
 		inline void Clear() {
 			_archetypes.clear();
 			_entityMap.clear();
+			_entityVersions.clear();
 			_archetypeHashIndices.clear();
+			_compactCursor = 0;
+			for (CachedComponentQuery &cached : _cachedQueries) {
+				cached.archetypeIndices.clear();
+			}
 			MemoryBlockAllocator::instance().Clear();
 			SharedComponentAllocator::instance().Clear();
 		}
@@ -9,6 +9,7 @@ namespace gleng {
 	/*
 	All types are in the same vector for efficiency.
 	The order is = {includes..., excludes..., shared includes..., shared excludes...}
+	Matching only uses the include and exclude masks, built from the registry indices of the same types.
 	*/
 	struct ComponentQuery {
 		std::vector<type_hash> types;
@@ -17,41 +18,27 @@ namespace gleng {
 		size_t shared_includes = 0;
 		size_t shared_excludes = 0;
 
+		ComponentMask includeMask;
+		ComponentMask excludeMask;
+
 		inline bool Matches(const EntityArchetype &archetype) const{
-			int i = 0;
-			//Loop over includes
-			size_t includesEnd = includes;
-			for (i; i < includesEnd; i++) {
-				if (!archetype.HasComponentType(types[i])) {
-					return false;
-				}
-			}
-			//Loop over excludes
-			size_t excludesEnd = includesEnd + excludes;
-			for (i; i < excludesEnd; i++) {
-				if (archetype.HasComponentType(types[i])) {
-					return false;
-				}
-			}
+			const ComponentMask &mask = archetype.GetMask();
+			return mask.ContainsAll(includeMask) && !mask.ContainsAny(excludeMask);
+		}
 
-			//Loop over shared includes
-			size_t sharedIncludesEnd = excludesEnd + shared_includes;
-			for (i; i < sharedIncludesEnd; i++) {
-				if (!archetype.HasSharedComponentType(types[i])) {
-					return false;
-				}
-			}
+		//Queries with the same masks match exactly the same archetypes
+		inline bool operator ==(const ComponentQuery &other) const {
+			return includeMask == other.includeMask && excludeMask == other.excludeMask;
+		}
+	};
 
-			//Loop over shared excludes
-			size_t sharedExcludesEnd = sharedIncludesEnd + shared_excludes;
-			for (i; i < sharedExcludesEnd; i++) {
-				if (archetype.HasSharedComponentType(types[i])) {
-					return false;
-				}
-			}
+	typedef size_t query_id;
+	constexpr query_id QUERY_ID_NONE = SIZE_MAX;
 
-			return true;
-		}
+	//Query registered with the ComponentManager. Keeps the indices of the matching archetypes up to date.
+	struct CachedComponentQuery {
+		ComponentQuery query;
+		std::vector<size_t> archetypeIndices;
 	};
 
 
@@ -65,6 +52,7 @@ namespace gleng {
 				type_hash type = IComponent<T>::ComponentTypeID;
 				query.types.insert(query.types.begin(), type);
 				query.includes++;
+				query.includeMask.Set(util::GetComponentIndex<T>());
 				return query;
 			}
 
@@ -73,10 +61,15 @@ namespace gleng {
 				type_hash type = IComponent<T>::ComponentTypeID;
 				query.types.insert(query.types.begin() + query.includes + query.excludes, type);
 				query.shared_includes++;
+				query.includeMask.Set(util::GetComponentIndex<T>());
 				return query;
 			}
 		};
 
+		//Read-only access matches the same archetypes
+		template <class T>
+		struct IncludeType<const T> : IncludeType<T> {};
+
 		template <class Q>
 		struct IncludeType<Optional<Q>> {
 			static ComponentQuery& Add(ComponentQuery& query) {
@@ -91,6 +84,7 @@ namespace gleng {
 				type_hash type = IComponent<T>::ComponentTypeID;
 				query.types.insert(query.types.begin() + query.includes, type);
 				query.excludes++;
+				query.excludeMask.Set(util::GetComponentIndex<T>());
 				return query;
 			}
 
@@ -99,10 +93,14 @@ namespace gleng {
 				type_hash type = IComponent<T>::ComponentTypeID;
 				query.types.insert(query.types.begin() + query.includes + query.excludes + query.shared_includes, type);
 				query.shared_excludes++;
+				query.excludeMask.Set(util::GetComponentIndex<T>());
 				return query;
 			}
 		};
 
+		template <class T>
+		struct ExcludeType<const T> : ExcludeType<T> {};
+
 		template <class Q>
 		struct ExcludeType<Optional<Q>> {
 			static ComponentQuery& Add(ComponentQuery& query) {
@@ -0,0 +1,247 @@
+#pragma once
+#include <stdint.h>
+#include <array>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "component.h"
+
+#ifndef ECS_NO_TSL
+#include "../tsl/robin_map.h"
+#else
+#include <unordered_map>
+#endif
+
+#if !defined(ECS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define ECS_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef ECS_MAX_COMPONENT_TYPES
+#define ECS_MAX_COMPONENT_TYPES 256
+#endif
+
+namespace gleng {
+
+	constexpr size_t COMPONENT_INDEX_NONE = SIZE_MAX;
+
+	struct ComponentInfo {
+		type_hash type = 0;
+		size_t memorySize = 0;
+		size_t alignment = 0;
+		bool shared = false;
+
+		//Lifetime operations on arrays of count components. Only set for components that aren't trivially copyable,
+		//memory blocks move the others with memcpy.
+		void(*construct)(void* dest, size_t count) = nullptr;
+		void(*move)(void* dest, void* src, size_t count) = nullptr; //Move constructs dest from src, src still needs destroying
+		void(*destroy)(void* ptr, size_t count) = nullptr;
+
+		inline bool IsTrivial() const {
+			return destroy == nullptr;
+		}
+	};
+
+	namespace util {
+		namespace lifetime {
+			template <class T>
+			inline void Construct(void* dest, size_t count) {
+				T* ptr = static_cast<T*>(dest);
+				for (size_t i = 0; i < count; ++i) {
+					new(ptr + i) T();
+				}
+			}
+
+			template <class T>
+			inline void Move(void* dest, void* src, size_t count) {
+				T* to = static_cast<T*>(dest);
+				T* from = static_cast<T*>(src);
+				for (size_t i = 0; i < count; ++i) {
+					new(to + i) T(std::move(from[i]));
+				}
+			}
+
+			template <class T>
+			inline void Destroy(void* ptr, size_t count) {
+				T* objects = static_cast<T*>(ptr);
+				for (size_t i = 0; i < count; ++i) {
+					objects[i].~T();
+				}
+			}
+
+			//Shared components live outside memory blocks and trivially copyable components are memcpy'd
+			template <class T, bool Managed = !std::is_trivially_copyable<T>::value && !std::is_base_of<ISharedComponent<T>, T>::value>
+			struct ComponentLifetime {
+				static inline void Set(ComponentInfo&) {}
+			};
+
+			template <class T>
+			struct ComponentLifetime<T, true> {
+				static inline void Set(ComponentInfo& info) {
+					static_assert(std::is_default_constructible<T>::value, "Components that aren't trivially copyable need a default constructor");
+					static_assert(std::is_move_constructible<T>::value, "Components that aren't trivially copyable need a move constructor");
+					info.construct = &Construct<T>;
+					info.move = &Move<T>;
+					info.destroy = &Destroy<T>;
+				}
+			};
+		}
+	}
+
+	/*
+	Hands out dense, sequential indices to component and shared component types the first time they are used.
+	Both kinds share one index space so an archetype's whole type set fits in one ComponentMask.
+	*/
+	class ComponentRegistry {
+		std::array<ComponentInfo, ECS_MAX_COMPONENT_TYPES> _components;
+		size_t _count = 0;
+#ifdef ECS_NO_TSL
+		std::unordered_map<type_hash, size_t, util::typehasher> _indices;
+#else
+		tsl::robin_map<type_hash, size_t, util::typehasher> _indices;
+#endif // ECS_NO_TSL
+		std::mutex _mutex;
+
+		ComponentRegistry() = default;
+	public:
+		template <class T>
+		inline size_t Register() {
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			type_hash type = util::GetTypeHash<T>();
+			auto found = _indices.find(type);
+			if (found != _indices.end()) {
+				return found->second;
+			}
+
+			if (_count >= ECS_MAX_COMPONENT_TYPES) {
+				throw std::length_error("Too many component types, increase ECS_MAX_COMPONENT_TYPES");
+			}
+
+			size_t index = _count;
+			ComponentInfo &info = _components[index];
+			info.type = type;
+			info.memorySize = sizeof(T);
+			info.alignment = alignof(T);
+			info.shared = std::is_base_of<ISharedComponent<T>, T>::value;
+			util::lifetime::ComponentLifetime<T>::Set(info);
+
+			_indices.emplace(type, index);
+			++_count;
+			return index;
+		}
+
+		//Slow path for code that only has the type hash. Returns COMPONENT_INDEX_NONE for unregistered types.
+		inline size_t FindIndex(type_hash type) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			auto found = _indices.find(type);
+			if (found != _indices.end()) {
+				return found->second;
+			}
+			return COMPONENT_INDEX_NONE;
+		}
+
+		inline const ComponentInfo& GetInfo(size_t index) const {
+			assert(index < _count);
+			return _components[index];
+		}
+
+		inline size_t Count() const {
+			return _count;
+		}
+
+		static ComponentRegistry& instance() {
+			static ComponentRegistry instance;
+			return instance;
+		}
+
+		ComponentRegistry(ComponentRegistry const&) = delete;
+		void operator=(ComponentRegistry const&) = delete;
+	};
+
+	namespace util {
+		template <class T>
+		inline size_t GetComponentIndex() {
+			static const size_t index = ComponentRegistry::instance().Register<T>();
+			return index;
+		}
+	}
+
+	//Fixed width bitset of component indices
+	struct ComponentMask {
+		static constexpr size_t numWords = (ECS_MAX_COMPONENT_TYPES + 127) / 128 * 2;
+
+		alignas(16) uint64_t words[numWords] = {};
+
+		inline void Set(size_t index) {
+			assert(index < numWords * 64);
+			words[index >> 6] |= (uint64_t)1 << (index & 63);
+		}
+
+		inline void Reset(size_t index) {
+			assert(index < numWords * 64);
+			words[index >> 6] &= ~((uint64_t)1 << (index & 63));
+		}
+
+		inline bool Test(size_t index) const {
+			assert(index < numWords * 64);
+			return (words[index >> 6] >> (index & 63)) & 1;
+		}
+
+		//True if every bit of other is also set in this mask
+		inline bool ContainsAll(const ComponentMask &other) const {
+#ifdef ECS_SSE2
+			for (size_t i = 0; i < numWords; i += 2) {
+				__m128i a = _mm_load_si128(reinterpret_cast<const __m128i*>(&words[i]));
+				__m128i b = _mm_load_si128(reinterpret_cast<const __m128i*>(&other.words[i]));
+				__m128i eq = _mm_cmpeq_epi32(_mm_and_si128(a, b), b);
+				if (_mm_movemask_epi8(eq) != 0xFFFF) {
+					return false;
+				}
+			}
+			return true;
+#else
+			for (size_t i = 0; i < numWords; ++i) {
+				if ((words[i] & other.words[i]) != other.words[i]) {
+					return false;
+				}
+			}
+			return true;
+#endif // ECS_SSE2
+		}
+
+		//True if any bit of other is also set in this mask
+		inline bool ContainsAny(const ComponentMask &other) const {
+#ifdef ECS_SSE2
+			__m128i acc = _mm_setzero_si128();
+			for (size_t i = 0; i < numWords; i += 2) {
+				__m128i a = _mm_load_si128(reinterpret_cast<const __m128i*>(&words[i]));
+				__m128i b = _mm_load_si128(reinterpret_cast<const __m128i*>(&other.words[i]));
+				acc = _mm_or_si128(acc, _mm_and_si128(a, b));
+			}
+			return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF;
+#else
+			uint64_t acc = 0;
+			for (size_t i = 0; i < numWords; ++i) {
+				acc |= words[i] & other.words[i];
+			}
+			return acc != 0;
+#endif // ECS_SSE2
+		}
+
+		inline bool operator ==(const ComponentMask &other) const {
+			for (size_t i = 0; i < numWords; ++i) {
+				if (words[i] != other.words[i]) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		inline bool operator !=(const ComponentMask &other) const {
+			return !(*this == other);
+		}
+	};
+}
@@ -6,15 +6,29 @@ namespace gleng {
 
 	constexpr uint32_t ENTITY_NULL_ID = 0;
 
+	/*
+	Entity handle. ID is the index of the entity and version is the generation of that index,
+	which is bumped every time the ID is freed so stale handles never alias a newer entity.
+	*/
 	struct Entity {
 		uint32_t ID = ENTITY_NULL_ID;
-		//uint_32_t version; //TODO
+		uint32_t version = 0;
 
 		inline bool operator ==(const Entity &b) const {
-			return ID == b.ID;
+			return ID == b.ID && version == b.version;
+		}
+
+		inline bool operator !=(const Entity &b) const {
+			return !(*this == b);
+		}
+
+		inline uint64_t Handle() const {
+			return (static_cast<uint64_t>(version) << 32) | ID;
 		}
 	};
 
+	static_assert(sizeof(Entity) == sizeof(uint64_t), "Entity should pack into a 64-bit handle");
+
 	struct EntityArray {
 		size_t size = 0;
 		std::shared_ptr<Entity[]> data;
@@ -48,8 +62,8 @@ namespace std {
 	template <>
 	struct hash<gleng::Entity> {
 		std::size_t operator()(const gleng::Entity& e) const {
-			static std::hash<uint32_t> hasher;
-			return hasher(e.ID);
+			static std::hash<uint64_t> hasher;
+			return hasher(e.Handle());
 		}
 	};
 
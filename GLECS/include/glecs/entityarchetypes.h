@@ -3,10 +3,15 @@
 #include <unordered_set>
 #include <unordered_map>
 #include "component.h"
+#include "componentregistry.h"
 #include <functional>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
 
-#ifndef ECS_NO_TSL
-#include "../tsl/robin_map.h"
+//Most (non-shared) components one archetype can have. Adding more throws std::length_error.
+#ifndef ECS_MAX_ARCHETYPE_COMPONENTS
+#define ECS_MAX_ARCHETYPE_COMPONENTS 32
 #endif
 
 namespace gleng {
@@ -17,17 +22,25 @@ namespace gleng {
 	public:
 		type_hash type;
 		size_t memorySize;
+		size_t alignment;
+		size_t index;
 		template <class T>
 		static ComponentType Get() {
 			CHECK_T_IS_COMPONENT;
 
-			static ComponentType ctype;
-			ctype.type = IComponent<T>::ComponentTypeID;
-			ctype.memorySize = sizeof(T);
+			//Built once so concurrent callers only read it
+			static const ComponentType ctype = []() {
+				ComponentType c;
+				c.type = IComponent<T>::ComponentTypeID;
+				c.memorySize = sizeof(T);
+				c.alignment = alignof(T);
+				c.index = util::GetComponentIndex<T>();
+				return c;
+			}();
 			return ctype;
 		}
 
-		inline bool operator ==(const ComponentType& other) {
+		inline bool operator ==(const ComponentType& other) const {
 			return type == other.type;
 		}
 
@@ -43,21 +56,32 @@ namespace gleng {
 		}
 	}
 
+	//Memory block size for an archetype's entities. Auto picks one from the size of an entity's components.
+	enum class ChunkSize : uint8_t {
+		Auto,
+		Small, //16 KB
+		Medium, //64 KB
+		Large //256 KB
+	};
+
+	/*
+	The identity of an archetype is its canonical signature: component types and shared components
+	kept sorted by type. The hash is only used to find candidates, equality always compares signatures.
+	The mask holds the registry index of every component and shared component type for fast matching.
+	The chunk size is only a hint and not part of the identity, the first use of an archetype decides it.
+	*/
 	class EntityArchetype {
-#ifdef ECS_NO_TSL
-		std::unordered_map<type_hash, size_t, util::typehasher> componentTypesMemory;
-		std::unordered_map<type_hash, void*, util::typehasher> sharedComponents;
-#else
-		tsl::robin_map<type_hash, size_t, util::typehasher> componentTypesMemory;
-		tsl::robin_map<type_hash, void*, util::typehasher> sharedComponents;
-#endif // ECS_NO_TSL
+		std::vector<ComponentType> componentTypes;
+		std::vector<std::pair<type_hash, void*>> sharedComponents;
+		ComponentMask mask;
 
 		type_hash _archetypeHash = 0;
+		ChunkSize _chunkSize = ChunkSize::Auto;
 
 		inline void GenerateHash() {
 			type_hash finalHash = 0;
-			for (auto hash : componentTypesMemory) {
-				finalHash ^= hash.first;
+			for (const ComponentType &component : componentTypes) {
+				finalHash ^= component.type;
 			}
 			static std::hash<void*> hasher;
 			for (auto pair : sharedComponents) {
@@ -68,50 +92,82 @@ namespace gleng {
 			_archetypeHash = finalHash;
 		}
 
+		inline std::vector<ComponentType>::const_iterator FindComponentType(type_hash componentType) const {
+			return std::lower_bound(componentTypes.begin(), componentTypes.end(), componentType,
+				[](const ComponentType& c, type_hash t) { return c.type < t; });
+		}
+
+		inline std::vector<std::pair<type_hash, void*>>::const_iterator FindSharedComponent(type_hash sharedComponentType) const {
+			return std::lower_bound(sharedComponents.begin(), sharedComponents.end(), sharedComponentType,
+				[](const std::pair<type_hash, void*>& c, type_hash t) { return c.first < t; });
+		}
+
 	public:
 		inline EntityArchetype() {
 			_archetypeHash = 0;
 		}
 
 		inline EntityArchetype(const ComponentType& component) {
-			componentTypesMemory.emplace(component.type, component.memorySize);
+			componentTypes.push_back(component);
+			mask.Set(component.index);
 			GenerateHash();
 		}
 
-		inline EntityArchetype(const EntityArchetype &other) {
-#ifdef ECS_NO_TSL
-			componentTypesMemory = std::unordered_map<type_hash, size_t, util::typehasher>(other.componentTypesMemory);
-			sharedComponents = std::unordered_map<type_hash, void*, util::typehasher>(other.sharedComponents);
-#else
-			componentTypesMemory = tsl::robin_map<type_hash, size_t, util::typehasher>(other.componentTypesMemory);
-			sharedComponents = tsl::robin_map<type_hash, void*, util::typehasher>(other.sharedComponents);
-#endif // ECS_NO_TSL
-			_archetypeHash = other._archetypeHash;
-		}
+		EntityArchetype(const EntityArchetype &other) = default;
+		EntityArchetype& operator =(const EntityArchetype &other) = default;
 
 		inline bool HasComponentType(type_hash componentType) const {
-			auto ptr = componentTypesMemory.find(componentType);
-			return ptr != componentTypesMemory.end();
+			auto found = FindComponentType(componentType);
+			return found != componentTypes.end() && found->type == componentType;
 		}
 
 		inline bool HasSharedComponentType(type_hash sharedComponentType) const {
-			auto ptr = sharedComponents.find(sharedComponentType);
-			return ptr != sharedComponents.end();
+			auto found = FindSharedComponent(sharedComponentType);
+			return found != sharedComponents.end() && found->first == sharedComponentType;
+		}
+
+		//True if the component or shared component with the given registry index is part of this archetype
+		inline bool HasComponentIndex(size_t index) const {
+			return mask.Test(index);
+		}
+
+		template <class T>
+		inline bool HasComponent() const {
+			CHECK_T_IS_COMPONENT;
+			return mask.Test(util::GetComponentIndex<T>());
+		}
+
+		template <class T>
+		inline bool HasSharedComponent() const {
+			CHECK_T_IS_SHARED_COMPONENT;
+			return mask.Test(util::GetComponentIndex<T>());
+		}
+
+		inline const ComponentMask& GetMask() const {
+			return mask;
 		}
 
 		inline EntityArchetype AddComponent(const ComponentType& component) const {
 			EntityArchetype newArch(*this);
-			newArch.componentTypesMemory.emplace(component.type, component.memorySize);
+			auto found = FindComponentType(component.type);
+			if (found == componentTypes.end() || found->type != component.type) {
+				if (componentTypes.size() >= ECS_MAX_ARCHETYPE_COMPONENTS) {
+					throw std::length_error("Too many components in one archetype, increase ECS_MAX_ARCHETYPE_COMPONENTS");
+				}
+				newArch.componentTypes.insert(newArch.componentTypes.begin() + (found - componentTypes.begin()), component);
+				newArch.mask.Set(component.index);
+			}
 			newArch.GenerateHash();
 			return newArch;
 		}
 
 		inline EntityArchetype RemoveComponent(const ComponentType& component) const {
 			EntityArchetype newArch(*this);
-			auto found = newArch.componentTypesMemory.find(component.type);
+			auto found = FindComponentType(component.type);
 
-			if (found != newArch.componentTypesMemory.end()) {
-				newArch.componentTypesMemory.erase(found);
+			if (found != componentTypes.end() && found->type == component.type) {
+				newArch.componentTypes.erase(newArch.componentTypes.begin() + (found - componentTypes.begin()));
+				newArch.mask.Reset(component.index);
 			}
 
 			newArch.GenerateHash();
@@ -122,53 +178,74 @@ namespace gleng {
 		inline EntityArchetype AddSharedComponent(T* component) const {
 			CHECK_T_IS_SHARED_COMPONENT;
 			EntityArchetype newArch(*this);
-			newArch.sharedComponents.emplace(ISharedComponent<T>::ComponentTypeID, component);
+			type_hash type = ISharedComponent<T>::ComponentTypeID;
+			auto found = FindSharedComponent(type);
+			if (found == sharedComponents.end() || found->first != type) {
+				newArch.sharedComponents.insert(newArch.sharedComponents.begin() + (found - sharedComponents.begin()),
+					std::pair<type_hash, void*>(type, component));
+				newArch.mask.Set(util::GetComponentIndex<T>());
+			}
 			newArch.GenerateHash();
 			return newArch;
 		}
 
 		inline EntityArchetype RemoveSharedComponent(type_hash sharedComponentType) const {
 			EntityArchetype newArch(*this);
-			auto found = newArch.sharedComponents.find(sharedComponentType);
+			auto found = FindSharedComponent(sharedComponentType);
 
-			if (found != newArch.sharedComponents.end()) {
-				newArch.sharedComponents.erase(found);
+			if (found != sharedComponents.end() && found->first == sharedComponentType) {
+				newArch.sharedComponents.erase(newArch.sharedComponents.begin() + (found - sharedComponents.begin()));
+				newArch.mask.Reset(ComponentRegistry::instance().FindIndex(sharedComponentType));
 			}
 
 			newArch.GenerateHash();
 			return newArch;
 		}
+
+		//True if both archetypes have exactly the same components and shared component instances
+		inline bool operator ==(const EntityArchetype& other) const {
+			if (_archetypeHash != other._archetypeHash || mask != other.mask) {
+				return false;
+			}
+			return sharedComponents == other.sharedComponents;
+		}
+
+		inline bool operator !=(const EntityArchetype& other) const {
+			return !(*this == other);
+		}
+
 		template <class T>
 		inline T* GetSharedComponent() const {
 			CHECK_T_IS_SHARED_COMPONENT;
-			auto found = sharedComponents.find(ISharedComponent<T>::ComponentTypeID);
-			if (found != sharedComponents.end()) {
+			type_hash type = ISharedComponent<T>::ComponentTypeID;
+			auto found = FindSharedComponent(type);
+			if (found != sharedComponents.end() && found->first == type) {
 				return static_cast<T*>(found->second);
 			} else {
 				return nullptr;
 			}
 		}
 
-#ifdef ECS_NO_TSL
-		inline const std::unordered_map<type_hash, size_t, util::typehasher> &GetComponentTypes() const {
-			return componentTypesMemory;
+		inline const std::vector<ComponentType> &GetComponentTypes() const {
+			return componentTypes;
 		}
 
-		inline const std::unordered_map<type_hash, void*, util::typehasher> &GetSharedComponents() const {
+		inline const std::vector<std::pair<type_hash, void*>> &GetSharedComponents() const {
 			return sharedComponents;
 		}
-#else
-		inline const tsl::robin_map<type_hash, size_t, util::typehasher> &GetComponentTypes() const {
-			return componentTypesMemory;
+
+		inline type_hash ArchetypeHash() const {
+			return _archetypeHash;
 		}
 
-		inline const tsl::robin_map<type_hash, void*, util::typehasher> &GetSharedComponents() const {
-			return sharedComponents;
+		inline EntityArchetype WithChunkSize(ChunkSize chunkSize) const {
+			EntityArchetype newArch(*this);
+			newArch._chunkSize = chunkSize;
+			return newArch;
 		}
-#endif // ECS_NO_TSL
 
-		inline type_hash ArchetypeHash() const {
-			return _archetypeHash;
+		inline ChunkSize GetChunkSize() const {
+			return _chunkSize;
 		}
 
 		template <class ...Components, class ...SharedComponents>
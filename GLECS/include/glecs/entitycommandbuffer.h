@@ -0,0 +1,478 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include "entity.h"
+#include "entityarchetypes.h"
+#include "worldaccessor.h"
+
+namespace gleng {
+
+	//Entities created through a command buffer have this version until the buffer is played back
+	constexpr uint32_t ENTITY_DEFERRED_VERSION = 0xFFFFFFFFu;
+
+	/*
+	Records structural changes so they can be made later, at a point where no chunks are being iterated.
+	Commands are stored back to back in one byte arena. Recording into one buffer is single threaded,
+	give each thread its own buffer and Merge them into one. Merge can be called from several threads.
+
+	Playback creates deferred entities in batches per archetype, destroys entities in one batch,
+	moves every changed entity once to its final archetype, grouped by that archetype, and then writes
+	the recorded component values in order. Commands for entities that are no longer alive are skipped.
+	*/
+	class EntityCommandBuffer {
+		enum class CommandType : uint8_t {
+			CreateEntity,
+			DestroyEntity,
+			ChangeArchetype,
+			SetComponent
+		};
+
+		typedef EntityArchetype(*ChangeArchetypeFunction)(const EntityArchetype& archetype, const void* payload);
+		typedef void(*SetComponentFunction)(ComponentManager* componentmanager, const Entity& e, const void* payload);
+
+		struct CommandHeader {
+			CommandType type;
+			uint32_t size; //Header and payload
+			Entity entity;
+			uint32_t componentIndex;
+			union {
+				ChangeArchetypeFunction changeArchetype;
+				SetComponentFunction setComponent;
+			};
+		};
+
+		static constexpr uint32_t STATE_NONE = UINT32_MAX;
+
+		struct LocalEdge {
+			ChangeArchetypeFunction function;
+			uint64_t key; //Shared component instance for shared component adds
+			uint32_t to;
+		};
+
+		struct LocalArchetype {
+			EntityArchetype archetype;
+			std::vector<LocalEdge> edges;
+		};
+
+		struct EntityState {
+			Entity entity;
+			bool destroyed = false;
+			uint32_t from = STATE_NONE; //Local archetypes, STATE_NONE if the archetype doesn't change
+			uint32_t to = STATE_NONE;
+			std::vector<std::pair<uint32_t, size_t>> removals; //Component index, command sequence number
+		};
+
+		struct SetCommand {
+			uint32_t state;
+			size_t offset;
+			size_t sequence;
+		};
+
+		std::vector<uint8_t> _commands;
+		std::vector<EntityArchetype> _createArchetypes;
+		uint32_t _numCreated = 0;
+		size_t _numCommands = 0;
+		std::mutex _mergeMutex;
+
+		//Playback scratch space, kept to reuse the memory next time
+		std::vector<EntityState> _states;
+		std::vector<uint32_t> _stateOfID;
+		std::vector<SetCommand> _sets;
+		std::vector<uint32_t> _moves;
+		std::vector<Entity> _moveGroup;
+
+		inline CommandHeader NewHeader(CommandType type, const Entity& e, uint32_t componentIndex = UINT32_MAX) const {
+			CommandHeader header = {};
+			header.type = type;
+			header.entity = e;
+			header.componentIndex = componentIndex;
+			return header;
+		}
+
+		inline void Record(CommandHeader header, const void* payload, size_t payloadSize) {
+			header.size = (uint32_t)(sizeof(CommandHeader) + payloadSize);
+
+			size_t offset = _commands.size();
+			_commands.resize(offset + header.size);
+			memcpy(&_commands[offset], &header, sizeof(CommandHeader));
+			if (payloadSize > 0) {
+				memcpy(&_commands[offset + sizeof(CommandHeader)], payload, payloadSize);
+			}
+			++_numCommands;
+		}
+
+		inline CommandHeader ReadHeader(size_t offset) const {
+			CommandHeader header;
+			memcpy(&header, &_commands[offset], sizeof(CommandHeader));
+			return header;
+		}
+
+		inline void RecordChange(const Entity& e, uint32_t componentIndex, ChangeArchetypeFunction function, const void* payload, size_t payloadSize) {
+			CommandHeader header = NewHeader(CommandType::ChangeArchetype, e, componentIndex);
+			header.changeArchetype = function;
+			Record(header, payload, payloadSize);
+		}
+
+		static inline bool IsDeferred(const Entity& e) {
+			return e.version == ENTITY_DEFERRED_VERSION;
+		}
+
+	public:
+		EntityCommandBuffer() = default;
+		EntityCommandBuffer(const EntityCommandBuffer&) = delete;
+		EntityCommandBuffer& operator =(const EntityCommandBuffer&) = delete;
+
+		//Returns a placeholder entity that can be used in later commands of this buffer
+		inline Entity CreateEntity(const EntityArchetype& archetype = EntityArchetype()) {
+			Entity e;
+			e.ID = _numCreated++;
+			e.version = ENTITY_DEFERRED_VERSION;
+
+			if (_createArchetypes.empty() || _createArchetypes.back() != archetype) {
+				_createArchetypes.push_back(archetype);
+			}
+			uint32_t archetypeIndex = (uint32_t)_createArchetypes.size() - 1;
+			Record(NewHeader(CommandType::CreateEntity, e), &archetypeIndex, sizeof(uint32_t));
+			return e;
+		}
+
+		inline void DestroyEntity(const Entity& e) {
+			Record(NewHeader(CommandType::DestroyEntity, e), nullptr, 0);
+		}
+
+		template <class T>
+		inline void AddComponent(const Entity& e) {
+			CHECK_T_IS_COMPONENT;
+			RecordChange(e, (uint32_t)util::GetComponentIndex<T>(), [](const EntityArchetype& archetype, const void*) {
+				return archetype.AddComponent(ComponentType::Get<T>());
+			}, nullptr, 0);
+		}
+
+		template <class T>
+		inline void AddComponent(const Entity& e, const T& value) {
+			CHECK_T_IS_COMPONENT;
+			AddComponent<T>(e);
+			SetComponent<T>(e, value);
+		}
+
+		template <class T>
+		inline void RemoveComponent(const Entity& e) {
+			CHECK_T_IS_COMPONENT;
+			RecordChange(e, (uint32_t)util::GetComponentIndex<T>(), [](const EntityArchetype& archetype, const void*) {
+				return archetype.RemoveComponent(ComponentType::Get<T>());
+			}, nullptr, 0);
+		}
+
+		template <class T>
+		inline void SetComponent(const Entity& e, const T& value) {
+			CHECK_T_IS_COMPONENT;
+			static_assert(std::is_trivially_copyable<T>::value, "Command buffers store component values as bytes, the component must be trivially copyable");
+			CommandHeader header = NewHeader(CommandType::SetComponent, e, (uint32_t)util::GetComponentIndex<T>());
+			header.setComponent = [](ComponentManager* componentmanager, const Entity& e, const void* payload) {
+				memcpy(&componentmanager->GetComponent<T>(e), payload, sizeof(T));
+			};
+			Record(header, &value, sizeof(T));
+		}
+
+		template <class T>
+		inline void AddSharedComponent(const Entity& e, T* component) {
+			CHECK_T_IS_SHARED_COMPONENT;
+			RecordChange(e, (uint32_t)util::GetComponentIndex<T>(), [](const EntityArchetype& archetype, const void* payload) {
+				T* shared;
+				memcpy(&shared, payload, sizeof(T*));
+				return archetype.AddSharedComponent(shared);
+			}, &component, sizeof(T*));
+		}
+
+		template <class T>
+		inline void RemoveSharedComponent(const Entity& e) {
+			CHECK_T_IS_SHARED_COMPONENT;
+			RecordChange(e, (uint32_t)util::GetComponentIndex<T>(), [](const EntityArchetype& archetype, const void*) {
+				return archetype.RemoveSharedComponent(ISharedComponent<T>::ComponentTypeID);
+			}, nullptr, 0);
+		}
+
+		//Moves all commands of other to the end of this buffer and clears other
+		inline void Merge(EntityCommandBuffer& other) {
+			std::lock_guard<std::mutex> lock(_mergeMutex);
+
+			uint32_t entityOffset = _numCreated;
+			uint32_t archetypeOffset = (uint32_t)_createArchetypes.size();
+
+			for (size_t offset = 0; offset < other._commands.size();) {
+				CommandHeader header = other.ReadHeader(offset);
+				if (IsDeferred(header.entity)) {
+					header.entity.ID += entityOffset;
+					memcpy(&other._commands[offset], &header, sizeof(CommandHeader));
+				}
+				if (header.type == CommandType::CreateEntity) {
+					uint32_t archetypeIndex;
+					memcpy(&archetypeIndex, &other._commands[offset + sizeof(CommandHeader)], sizeof(uint32_t));
+					archetypeIndex += archetypeOffset;
+					memcpy(&other._commands[offset + sizeof(CommandHeader)], &archetypeIndex, sizeof(uint32_t));
+				}
+				offset += header.size;
+			}
+
+			_commands.insert(_commands.end(), other._commands.begin(), other._commands.end());
+			_createArchetypes.insert(_createArchetypes.end(), other._createArchetypes.begin(), other._createArchetypes.end());
+			_numCreated += other._numCreated;
+			_numCommands += other._numCommands;
+
+			other.Clear();
+		}
+
+		inline void Playback(const WorldAccessor& world) {
+			EntityManager *entitymanager = world.entitymanager;
+			ComponentManager *componentmanager = world.componentmanager;
+
+			//Create deferred entities, one batch per archetype
+			std::vector<Entity> created(_numCreated);
+			std::vector<std::pair<uint32_t, uint32_t>> creates; //archetype index, deferred ID
+			for (size_t offset = 0; offset < _commands.size();) {
+				CommandHeader header = ReadHeader(offset);
+				if (header.type == CommandType::CreateEntity) {
+					uint32_t archetypeIndex;
+					memcpy(&archetypeIndex, &_commands[offset + sizeof(CommandHeader)], sizeof(uint32_t));
+					creates.emplace_back(archetypeIndex, header.entity.ID);
+				}
+				offset += header.size;
+			}
+
+			//Equal archetypes recorded separately are created in the same batch
+			std::vector<uint32_t> distinctOf(_createArchetypes.size());
+			std::vector<uint32_t> distinct;
+			for (uint32_t i = 0; i < _createArchetypes.size(); ++i) {
+				distinctOf[i] = i;
+				for (uint32_t d : distinct) {
+					if (_createArchetypes[d] == _createArchetypes[i]) {
+						distinctOf[i] = d;
+						break;
+					}
+				}
+				if (distinctOf[i] == i) {
+					distinct.push_back(i);
+				}
+			}
+			for (std::pair<uint32_t, uint32_t> &create : creates) {
+				create.first = distinctOf[create.first];
+			}
+			std::stable_sort(creates.begin(), creates.end(), [](const std::pair<uint32_t, uint32_t>& a, const std::pair<uint32_t, uint32_t>& b) {
+				return a.first < b.first;
+			});
+			for (size_t start = 0; start < creates.size();) {
+				size_t end = start;
+				while (end < creates.size() && creates[end].first == creates[start].first) {
+					++end;
+				}
+				EntityArray arr = entitymanager->CreateEntities(end - start, _createArchetypes[creates[start].first]);
+				for (size_t i = start; i < end; ++i) {
+					created[creates[i].second] = arr[i - start];
+				}
+				start = end;
+			}
+
+			//Fold the structural commands of each entity into its final archetype.
+			//Archetypes are numbered locally and transitions between them are cached, like the ComponentManager does.
+			std::vector<LocalArchetype> archetypes;
+			std::unordered_map<const EntityArchetype*, uint32_t> localIndices;
+			const EntityArchetype *lastSource = nullptr;
+			uint32_t lastSourceIndex = STATE_NONE;
+			std::vector<EntityState> &states = _states;
+			std::vector<uint32_t> &stateOfID = _stateOfID;
+			std::vector<SetCommand> &sets = _sets;
+
+			size_t sequence = 0;
+			for (size_t offset = 0; offset < _commands.size(); ++sequence) {
+				CommandHeader header = ReadHeader(offset);
+				size_t commandOffset = offset;
+				offset += header.size;
+
+				if (header.type == CommandType::CreateEntity) {
+					continue;
+				}
+
+				Entity e = IsDeferred(header.entity) ? created[header.entity.ID] : header.entity;
+				if (!componentmanager->IsEntityValid(e)) {
+					continue;
+				}
+
+				if (e.ID >= stateOfID.size()) {
+					stateOfID.resize(std::max<size_t>(e.ID + 1, stateOfID.size() * 2), STATE_NONE);
+				}
+				if (stateOfID[e.ID] == STATE_NONE) {
+					stateOfID[e.ID] = (uint32_t)states.size();
+					states.emplace_back();
+					states.back().entity = e;
+				}
+				uint32_t stateIndex = stateOfID[e.ID];
+				EntityState &state = states[stateIndex];
+				if (state.destroyed) {
+					continue;
+				}
+
+				switch (header.type) {
+				case CommandType::DestroyEntity:
+					state.destroyed = true;
+					break;
+				case CommandType::ChangeArchetype: {
+					if (state.from == STATE_NONE) {
+						const EntityArchetype *source = &componentmanager->GetEntityArchetype(e);
+						if (source != lastSource) {
+							auto found = localIndices.find(source);
+							if (found == localIndices.end()) {
+								found = localIndices.emplace(source, (uint32_t)archetypes.size()).first;
+								archetypes.emplace_back();
+								archetypes.back().archetype = *source;
+							}
+							lastSource = source;
+							lastSourceIndex = found->second;
+						}
+						state.from = state.to = lastSourceIndex;
+					}
+
+					const void* payload = &_commands[commandOffset + sizeof(CommandHeader)];
+					size_t payloadSize = header.size - sizeof(CommandHeader);
+					uint64_t key = 0;
+					memcpy(&key, payload, std::min<size_t>(payloadSize, sizeof(key)));
+
+					uint32_t to = STATE_NONE;
+					for (const LocalEdge &edge : archetypes[state.to].edges) {
+						if (edge.function == header.changeArchetype && edge.key == key) {
+							to = edge.to;
+							break;
+						}
+					}
+					if (to == STATE_NONE) {
+						EntityArchetype changed = header.changeArchetype(archetypes[state.to].archetype, payload);
+						for (uint32_t i = 0; i < archetypes.size(); ++i) {
+							if (archetypes[i].archetype == changed) {
+								to = i;
+								break;
+							}
+						}
+						if (to == STATE_NONE) {
+							to = (uint32_t)archetypes.size();
+							archetypes.emplace_back();
+							archetypes.back().archetype = changed;
+						}
+						LocalEdge edge = { header.changeArchetype, key, to };
+						archetypes[state.to].edges.push_back(edge);
+					}
+
+					//Values set before the component was removed don't survive
+					if (archetypes[state.to].archetype.HasComponentIndex(header.componentIndex)
+						&& !archetypes[to].archetype.HasComponentIndex(header.componentIndex)) {
+						state.removals.emplace_back(header.componentIndex, sequence);
+					}
+					state.to = to;
+					break;
+				}
+				case CommandType::SetComponent: {
+					SetCommand set = { stateIndex, commandOffset, sequence };
+					sets.push_back(set);
+					break;
+				}
+				default:
+					break;
+				}
+			}
+
+			EntityArray destroyed;
+			size_t numDestroyed = 0;
+			for (const EntityState &state : states) {
+				numDestroyed += state.destroyed ? 1 : 0;
+			}
+			if (numDestroyed > 0) {
+				destroyed.size = numDestroyed;
+				destroyed.data = std::shared_ptr<Entity[]>(new Entity[numDestroyed]);
+				size_t i = 0;
+				for (const EntityState &state : states) {
+					if (state.destroyed) {
+						destroyed.data[i++] = state.entity;
+					}
+				}
+				entitymanager->DestroyEntities(destroyed);
+			}
+
+			//Move each changed entity once, grouped by destination archetype
+			std::vector<uint32_t> &moves = _moves;
+			for (uint32_t i = 0; i < states.size(); ++i) {
+				if (!states[i].destroyed && states[i].from != states[i].to) {
+					moves.push_back(i);
+				}
+			}
+			std::stable_sort(moves.begin(), moves.end(), [&states](uint32_t a, uint32_t b) {
+				return states[a].to < states[b].to;
+			});
+			std::vector<Entity> &group = _moveGroup;
+			for (size_t start = 0; start < moves.size();) {
+				uint32_t to = states[moves[start]].to;
+				group.clear();
+				size_t end = start;
+				for (; end < moves.size() && states[moves[end]].to == to; ++end) {
+					group.push_back(states[moves[end]].entity);
+				}
+				componentmanager->MoveToArchetype(group.data(), group.size(), archetypes[to].archetype);
+				start = end;
+			}
+
+			//A component removed and added again starts over, like it does with the ComponentManager.
+			//It was kept in place, or moved along with the entity, so it still holds the old value.
+			for (const EntityState &state : states) {
+				if (state.destroyed || state.removals.empty()) {
+					continue;
+				}
+				const EntityArchetype &original = archetypes[state.from].archetype;
+				const EntityArchetype &target = archetypes[state.to].archetype;
+				for (const std::pair<uint32_t, size_t> &removal : state.removals) {
+					if (original.HasComponentIndex(removal.first) && target.HasComponentIndex(removal.first)) {
+						componentmanager->ResetComponent(state.entity, removal.first);
+					}
+				}
+			}
+
+			for (const SetCommand &set : sets) {
+				const EntityState &state = states[set.state];
+				if (state.destroyed) {
+					continue;
+				}
+				CommandHeader header = ReadHeader(set.offset);
+				bool removedLater = false;
+				for (const std::pair<uint32_t, size_t> &removal : state.removals) {
+					removedLater |= removal.first == header.componentIndex && removal.second > set.sequence;
+				}
+				if (!removedLater && componentmanager->GetEntityArchetype(state.entity).HasComponentIndex(header.componentIndex)) {
+					header.setComponent(componentmanager, state.entity, &_commands[set.offset + sizeof(CommandHeader)]);
+				}
+			}
+
+			for (const EntityState &state : states) {
+				stateOfID[state.entity.ID] = STATE_NONE;
+			}
+			states.clear();
+			sets.clear();
+			moves.clear();
+			Clear();
+		}
+
+		inline size_t Size() const {
+			return _numCommands;
+		}
+
+		inline bool Empty() const {
+			return _numCommands == 0;
+		}
+
+		inline void Clear() {
+			_commands.clear();
+			_createArchetypes.clear();
+			_numCreated = 0;
+			_numCommands = 0;
+		}
+	};
+}
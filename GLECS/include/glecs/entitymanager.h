@@ -10,17 +10,21 @@ namespace gleng {
 	class EntityManager {
 		std::vector<uint32_t> freeIDs;
 		uint32_t nextid = 1;
-		inline uint32_t NextID() {
+
+		EventManager *_eventmanager;
+		ComponentManager *_componentmanager;
+
+		inline Entity NextEntity() {
+			Entity entity;
 			if (freeIDs.size() > 0) {
-				uint32_t lastIdx = freeIDs[freeIDs.size() - 1];
+				entity.ID = freeIDs[freeIDs.size() - 1];
 				freeIDs.pop_back();
-				return lastIdx;
+			} else {
+				entity.ID = nextid++;
 			}
-			return nextid++;
+			entity.version = _componentmanager->GetEntityVersion(entity.ID);
+			return entity;
 		}
-
-		EventManager *_eventmanager;
-		ComponentManager *_componentmanager;
 	public:
 
 		inline EntityManager(ComponentManager * cm, EventManager * em) {
@@ -29,8 +33,7 @@ namespace gleng {
 		}
 
 		inline Entity CreateEntity() {
-			Entity entity;
-			entity.ID = EntityManager::NextID();
+			Entity entity = NextEntity();
 
 			_componentmanager->AddEntity(entity);
 			_eventmanager->QueueEvent(EntityCreatedEvent(entity));
@@ -39,20 +42,8 @@ namespace gleng {
 		}
 
 		inline EntityArray CreateEntities(size_t number) {
-			EntityArray arr;
-			arr.size = number;
-
-			if (number > 0) {
-				arr.data = std::shared_ptr<Entity[]>(new Entity[number]);
-
-				for (int i = 0; i < number; ++i) {
-					arr.data[i].ID = EntityManager::NextID();
-					_componentmanager->AddEntity(arr.data[i]);
-					_eventmanager->QueueEvent(EntityCreatedEvent(arr.data[i]));
-				}
-			}
-
-			return arr;
+			static const EntityArchetype empty;
+			return CreateEntities(number, empty);
 		}
 
 		inline EntityArray CreateEntities(size_t number, const EntityArchetype &archetype) {
@@ -62,10 +53,15 @@ namespace gleng {
 			if (number > 0) {
 				arr.data = std::shared_ptr<Entity[]>(new Entity[number]);
 
-				for (int i = 0; i < number; ++i) {
-					arr.data[i].ID = EntityManager::NextID();
-					_componentmanager->AddEntity(arr.data[i], archetype);
-					_eventmanager->QueueEvent(EntityCreatedEvent(arr.data[i]));
+				for (size_t i = 0; i < number; ++i) {
+					arr.data[i] = NextEntity();
+				}
+
+				_componentmanager->AddEntities(arr.begin(), number, archetype);
+
+				EntityCreatedEvent *events = _eventmanager->QueueEvents<EntityCreatedEvent>(number);
+				for (size_t i = 0; i < number; ++i) {
+					events[i].entity = arr.data[i];
 				}
 			}
 
@@ -73,8 +69,7 @@ namespace gleng {
 		}
 
 		inline Entity CreateEntity(const EntityArchetype &archetype) {
-			Entity entity;
-			entity.ID = EntityManager::NextID();
+			Entity entity = NextEntity();
 
 			_componentmanager->AddEntity(entity, archetype);
 
@@ -95,15 +90,21 @@ namespace gleng {
 		}
 
 		inline void DestroyEntities(const EntityArray& entities) {
-			//TODO: check that is invalid block index in componentmanager
+			if (entities.size == 0) {
+				return;
+			}
+
 			for (const Entity& entity : entities) {
 				assert(_componentmanager->IsEntityValid(entity));
-				//assert(std::find(freeIDs.begin(), freeIDs.end(), entity.ID) == freeIDs.end());
 				assert(entity.ID != ENTITY_NULL_ID);
+			}
+
+			_componentmanager->RemoveEntities(entities.begin(), entities.size);
 
-				_componentmanager->RemoveEntity(entity);
-				freeIDs.push_back(entity.ID);
-				_eventmanager->QueueEvent(EntityDestroyedEvent(entity));
+			EntityDestroyedEvent *events = _eventmanager->QueueEvents<EntityDestroyedEvent>(entities.size);
+			for (size_t i = 0; i < entities.size; ++i) {
+				freeIDs.push_back(entities[i].ID);
+				events[i].entity = entities[i];
 			}
 		}
 
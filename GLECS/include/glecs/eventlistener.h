@@ -30,6 +30,8 @@ namespace gleng {
 	template <class T>
 	class IEventListener {
 	public:
+		//With parallel delivery, listeners run on the ThreadPool unless this is set
+		bool mainThreadOnly = false;
 		virtual void ProcessEvents(const EventIterator<T>&) = 0;
 	};
 
@@ -1,5 +1,12 @@
 #pragma once
 #include "eventlistener.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #ifndef ECS_NO_TSL
 #include "../tsl/robin_map.h"
@@ -9,25 +16,155 @@ namespace gleng {
 
 	class IEventQueue {
 	public:
+		virtual ~IEventQueue() = default;
 		virtual void DeliverEvents() = 0;
+		virtual bool HasPendingEvents() = 0;
+
+		//Delivery in steps for parallel dispatch. Begin merges the producers and returns whether any listener has events to process.
+		virtual bool BeginDelivery() = 0;
+		virtual size_t ListenerCount() const = 0;
+		virtual bool ListenerNeedsMainThread(size_t listener) const = 0;
+		virtual void DeliverTo(size_t listener) = 0;
+		virtual void EndDelivery() = 0;
+	};
+
+	namespace util {
+		inline uint64_t NextEventQueueId() {
+			static std::atomic<uint64_t> counter(1);
+			return counter++;
+		}
+	}
+
+	//Appends events to one producer's buffer of an EventQueue. Each producer must only be used by one thread at a time.
+	template <class T>
+	class EventProducer {
+		std::vector<T>* _events;
+	public:
+		inline explicit EventProducer(std::vector<T>* events) : _events(events) {}
+
+		inline void AddEvent(const T& e) {
+			_events->push_back(e);
+		}
 	};
 
+	/*
+	Events added with AddEvent go straight to the queue and must come from one thread.
+	Other threads add events through producer buffers, which are merged into the queue at DeliverEvents:
+	first the keyed producers in ascending key order, then the per-thread buffers of AddEventConcurrent.
+	Keyed producers give the same event order on every run as long as the keys don't depend on thread scheduling,
+	e.g. a chunk or job index. Producers must be done before DeliverEvents is called.
+
+	The queue is double buffered. Delivery swaps the pending events into a second buffer and hands that to the listeners,
+	so events queued while listeners run go to the now empty first buffer and wait for the next delivery.
+	Both buffers keep their capacity between deliveries.
+	*/
 	template <class T>
 	class EventQueue : public IEventQueue {
+		struct KeyedBuffer {
+			uint64_t key;
+			std::vector<T> events;
+		};
+
+		struct ThreadBuffer {
+			std::thread::id thread;
+			std::vector<T> events;
+		};
+
 		std::vector<IEventListener<T>*> listeners;
 		std::vector<T> events;
+		//events being delivered
+		std::vector<T> delivering;
+
+		const uint64_t queueId = util::NextEventQueueId();
+		std::mutex producerMutex;
+		//sorted by key, buffers are kept between deliveries to reuse their memory
+		std::vector<std::unique_ptr<KeyedBuffer>> keyedBuffers;
+		std::vector<std::unique_ptr<ThreadBuffer>> threadBuffers;
+
+		inline std::vector<T>* FindThreadBuffer() {
+			std::lock_guard<std::mutex> lock(producerMutex);
+			std::thread::id thread = std::this_thread::get_id();
+			for (std::unique_ptr<ThreadBuffer> &buffer : threadBuffers) {
+				if (buffer->thread == thread) {
+					return &buffer->events;
+				}
+			}
+			threadBuffers.emplace_back(new ThreadBuffer());
+			threadBuffers.back()->thread = thread;
+			return &threadBuffers.back()->events;
+		}
+
+		inline void MergeProducerEvents() {
+			std::lock_guard<std::mutex> lock(producerMutex);
+			for (std::unique_ptr<KeyedBuffer> &buffer : keyedBuffers) {
+				events.insert(events.end(), buffer->events.begin(), buffer->events.end());
+				buffer->events.clear();
+			}
+			for (std::unique_ptr<ThreadBuffer> &buffer : threadBuffers) {
+				events.insert(events.end(), buffer->events.begin(), buffer->events.end());
+				buffer->events.clear();
+			}
+		}
+
+		inline bool HasProducerEvents() {
+			std::lock_guard<std::mutex> lock(producerMutex);
+			for (std::unique_ptr<KeyedBuffer> &buffer : keyedBuffers) {
+				if (!buffer->events.empty()) {
+					return true;
+				}
+			}
+			for (std::unique_ptr<ThreadBuffer> &buffer : threadBuffers) {
+				if (!buffer->events.empty()) {
+					return true;
+				}
+			}
+			return false;
+		}
+
 	public:
 		virtual void DeliverEvents() {
-			if (events.size() == 0) {
+			if (!BeginDelivery()) {
+				EndDelivery();
 				return;
-			} else {
-				EventIterator<T> eit(&events[0], events.size());
-				for (IEventListener<T>* listener : listeners) {
-					listener->ProcessEvents(eit);
-				}
+			}
+
+			EventIterator<T> eit(&delivering[0], delivering.size());
+			for (IEventListener<T>* listener : listeners) {
+				listener->ProcessEvents(eit);
+			}
+
+			EndDelivery();
+		}
+
+		virtual bool HasPendingEvents() {
+			return !events.empty() || HasProducerEvents();
+		}
 
+		virtual bool BeginDelivery() {
+			MergeProducerEvents();
+			if (listeners.empty()) {
 				events.clear();
+				return false;
 			}
+			delivering.swap(events);
+			return !delivering.empty();
+		}
+
+		virtual size_t ListenerCount() const {
+			return listeners.size();
+		}
+
+		virtual bool ListenerNeedsMainThread(size_t listener) const {
+			return listeners[listener]->mainThreadOnly;
+		}
+
+		virtual void DeliverTo(size_t listener) {
+			EventIterator<T> eit(&delivering[0], delivering.size());
+			listeners[listener]->ProcessEvents(eit);
+		}
+
+		virtual void EndDelivery() {
+			delivering.clear();
 		}
 
 		inline void AddListener(IEventListener<T>* listener) {
@@ -47,37 +184,169 @@ namespace gleng {
 		inline void AddEvent(const T& e) {
 			events.push_back(e);
 		}
+
+		//Appends count default constructed events and returns a pointer to the first one.
+		//The pointer is only valid until the next event is added.
+		inline T* AddEvents(size_t count) {
+			size_t first = events.size();
+			events.resize(first + count);
+			return &events[first];
+		}
+
+		//Thread safe. Returns the producer for key, creating its buffer the first time the key is used.
+		inline EventProducer<T> GetProducer(uint64_t key) {
+			std::lock_guard<std::mutex> lock(producerMutex);
+			auto found = std::lower_bound(keyedBuffers.begin(), keyedBuffers.end(), key,
+				[](const std::unique_ptr<KeyedBuffer> &buffer, uint64_t k) { return buffer->key < k; });
+			if (found == keyedBuffers.end() || (*found)->key != key) {
+				found = keyedBuffers.emplace(found, new KeyedBuffer());
+				(*found)->key = key;
+			}
+			return EventProducer<T>(&(*found)->events);
+		}
+
+		//Thread safe. Adds the event to the calling thread's buffer. The order between threads isn't deterministic.
+		inline void AddEventConcurrent(const T& e) {
+			struct CachedBuffer {
+				uint64_t queueId = 0;
+				std::vector<T>* events = nullptr;
+			};
+			static thread_local CachedBuffer cached;
+			if (cached.queueId != queueId) {
+				cached.events = FindThreadBuffer();
+				cached.queueId = queueId;
+			}
+			cached.events->push_back(e);
+		}
 	};
 
 	class EventManager {
-#ifdef ECS_NO_TSL
-		std::unordered_map<type_hash, IEventQueue*, util::typehasher> _eventQueues;
-#else
-		tsl::robin_map<type_hash, IEventQueue*, util::typehasher> _eventQueues;
-#endif // ECS_NO_TSL
+		//indexed by util::GetEventIndex, null for event types that haven't been used with this manager
+		std::vector<IEventQueue*> _eventQueues;
+		//guards queue creation from worker threads
+		std::mutex _queueMutex;
+
+		struct ListenerDispatch {
+			IEventQueue* queue;
+			size_t listener;
+		};
+
+		ThreadPool* _deliveryPool = nullptr;
+		size_t _maxDeliveryPasses = 1;
+		std::vector<ListenerDispatch> _parallelDispatch;
+		std::vector<ListenerDispatch> _mainThreadDispatch;
+
+		inline void DeliverEventsParallel() {
+			_parallelDispatch.clear();
+			_mainThreadDispatch.clear();
+			for (IEventQueue* queue : _eventQueues) {
+				if (queue == nullptr || !queue->BeginDelivery()) {
+					continue;
+				}
+				for (size_t i = 0; i < queue->ListenerCount(); ++i) {
+					ListenerDispatch dispatch = { queue, i };
+					if (queue->ListenerNeedsMainThread(i)) {
+						_mainThreadDispatch.push_back(dispatch);
+					} else {
+						_parallelDispatch.push_back(dispatch);
+					}
+				}
+			}
+
+			//Listeners run from the dispatch lists, queues they create while running don't disturb them
+			_deliveryPool->ParallelFor(_parallelDispatch.size(), 1, [this](size_t i) {
+				_parallelDispatch[i].queue->DeliverTo(_parallelDispatch[i].listener);
+			});
 
+			for (const ListenerDispatch &dispatch : _mainThreadDispatch) {
+				dispatch.queue->DeliverTo(dispatch.listener);
+			}
+
+			for (IEventQueue* queue : _eventQueues) {
+				if (queue != nullptr) {
+					queue->EndDelivery();
+				}
+			}
+		}
+
+		template<class T>
+		EventQueue<T>* CreateEventQueue(size_t index) {
+			if (index >= _eventQueues.size()) {
+				_eventQueues.resize(index + 1, nullptr);
+			}
+			EventQueue<T> *newQue = new EventQueue<T>();
+			_eventQueues[index] = newQue;
+			return newQue;
+		}
 
 		template<class T>
 		inline EventQueue<T>* GetOrCreateEventQueue() {
 			CHECK_T_IS_EVENT;
-			type_hash type = IEvent<T>::EventTypeID;
-			auto found = _eventQueues.find(type);
-			if (found != _eventQueues.end()) {
-				return static_cast<EventQueue<T>*>(found->second);
-			} else {
-				EventQueue<T> *newQue = new EventQueue<T>();
-				_eventQueues.emplace(type, newQue);
-				return newQue;
+			size_t index = util::GetEventIndex<T>();
+			if (index < _eventQueues.size() && _eventQueues[index] != nullptr) {
+				return static_cast<EventQueue<T>*>(_eventQueues[index]);
 			}
+			return CreateEventQueue<T>(index);
 		}
 	public:
 
+		inline bool HasPendingEvents() const {
+			for (IEventQueue* queue : _eventQueues) {
+				if (queue != nullptr && queue->HasPendingEvents()) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		//Delivers queued events, then keeps delivering the events listeners queued meanwhile
+		//until no events are left or the pass limit set with SetMaxDeliveryPasses is reached.
 		inline void DeliverEvents() {
-			for (auto keyval : _eventQueues) {
-				keyval.second->DeliverEvents();
+			for (size_t pass = 0; pass < _maxDeliveryPasses; ++pass) {
+				if (pass > 0 && !HasPendingEvents()) {
+					return;
+				}
+
+				if (_deliveryPool != nullptr) {
+					DeliverEventsParallel();
+					continue;
+				}
+				//Listeners may queue events of a new type, which grows _eventQueues while it's walked
+				for (size_t i = 0; i < _eventQueues.size(); ++i) {
+					if (_eventQueues[i] != nullptr) {
+						_eventQueues[i]->DeliverEvents();
+					}
+				}
 			}
 		}
 
+		//1 by default, so events queued during delivery wait for the next DeliverEvents call
+		inline void SetMaxDeliveryPasses(size_t passes) {
+			assert(passes > 0);
+			_maxDeliveryPasses = passes;
+		}
+
+		/*
+		Opt-in parallel delivery. All queues are merged first, then every listener of every event type is run as its own task
+		on the pool, and listeners marked mainThreadOnly run on the calling thread afterwards.
+		Listeners must then be safe to run alongside each other, including one object listening to several event types.
+		Events they raise go through producers or AddEventConcurrent, mainThreadOnly listeners can queue events normally.
+		Clear turns parallel delivery off again.
+		*/
+		inline void SetParallelDelivery(bool enabled, ThreadPool &pool = ThreadPool::instance()) {
+			_deliveryPool = enabled ? &pool : nullptr;
+		}
+
+		/*
+		Returns the queue for events of type T. Code that fires a lot of events can hold on to it
+		and add events directly, skipping the lookup. The handle stays valid until Clear is called.
+		*/
+		template <class T>
+		inline EventQueue<T>& GetEventQueue() {
+			CHECK_T_IS_EVENT;
+			return *GetOrCreateEventQueue<T>();
+		}
+
 		template <class T>
 		inline void RegisterListener(IEventListener<T>* listener) {
 			CHECK_T_IS_EVENT;
@@ -99,11 +368,38 @@ namespace gleng {
 			queue->AddEvent(e);
 		}
 
+		/*
+		Thread safe, meant to be called once per job on a worker thread. See EventQueue for the merge order.
+		Worker threads can also call AddEventConcurrent on a queue handle taken beforehand with GetEventQueue.
+		Calls from worker threads must not overlap with the other, single threaded functions of the EventManager.
+		*/
+		template <class T>
+		inline EventProducer<T> GetEventProducer(uint64_t key) {
+			CHECK_T_IS_EVENT;
+			EventQueue<T>* queue;
+			{
+				std::lock_guard<std::mutex> lock(_queueMutex);
+				queue = GetOrCreateEventQueue<T>();
+			}
+			return queue->GetProducer(key);
+		}
+
+		//Queues count events at once. Returns a pointer to the events which the caller fills in.
+		template <class T>
+		inline T* QueueEvents(size_t count) {
+			CHECK_T_IS_EVENT;
+			assert(count > 0);
+			EventQueue<T>* queue = GetOrCreateEventQueue<T>();
+			return queue->AddEvents(count);
+		}
+
 		inline void Clear() {
-			for (auto keyval : _eventQueues) {
-				delete(keyval.second);
+			for (IEventQueue* queue : _eventQueues) {
+				delete(queue);
 			}
 			_eventQueues.clear();
+			_deliveryPool = nullptr;
+			_maxDeliveryPasses = 1;
 		}
 
 		inline ~EventManager() {
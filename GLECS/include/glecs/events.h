@@ -1,6 +1,7 @@
 #pragma once
 #include "util.h"
 #include "entity.h"
+#include <atomic>
 
 #define CHECK_T_IS_EVENT static_assert(std::is_base_of<IEvent<T>, T>::value, "T is not of type Event");
 
@@ -15,6 +16,20 @@ namespace gleng {
 	template <class T>
 	const type_hash IEvent<T>::EventTypeID = util::GetTypeHash<T>();
 
+	namespace util {
+		inline size_t NextEventIndex() {
+			static std::atomic<size_t> counter(0);
+			return counter++;
+		}
+
+		//Dense per-type index, assigned the first time an event type is used. EventManager keeps its queues in a vector by this index.
+		template <class T>
+		inline size_t GetEventIndex() {
+			static const size_t index = NextEventIndex();
+			return index;
+		}
+	}
+
 
 	struct EntityCreatedEvent : public IEvent<EntityCreatedEvent> {
 		Entity entity;
@@ -2,17 +2,154 @@
 #include "entity.h"
 #include "component.h"
 #include "entityarchetypes.h"
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <unordered_map>
 
-#ifndef ECS_NO_TSL
-#include "../tsl/robin_map.h"
+
+//Auto sized archetypes use the smallest chunk size that holds at least this many entities
+#ifndef ECS_MIN_CHUNK_ENTITIES
+#define ECS_MIN_CHUNK_ENTITIES 64
+#endif
+
+/*
+By default rows are zeroed when entities leave them, so new entities find zeroed components.
+ECS_NO_ZERO_MEMORY skips that and zeroes rows when they're reused instead, so dead memory is never touched.
+ECS_POISON_MEMORY does the same but fills vacated rows with ECS_POISON_BYTE to catch reads of removed entities.
+*/
+#if defined(ECS_NO_ZERO_MEMORY) || defined(ECS_POISON_MEMORY)
+#define ECS_ZERO_ON_REUSE
+#endif
+
+#ifndef ECS_POISON_BYTE
+#define ECS_POISON_BYTE 0xDD
+#endif
+
+//Minimum alignment of every component column, e.g. 32 for AVX or 64 for whole cache lines.
+//Columns are always aligned to at least alignof(T).
+#ifndef ECS_COLUMN_ALIGNMENT
+#define ECS_COLUMN_ALIGNMENT 1
+#endif
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
 #endif
 
 
 namespace gleng {
 
-	struct MemoryPtr {
-		void* ptr;
-		size_t size;
+	namespace util {
+		namespace pages {
+			constexpr size_t hugePageSize = MB(2);
+			constexpr size_t pageSize = KB(4);
+
+			//Reserves and commits size bytes of page aligned memory straight from the OS.
+			//Uses huge pages when they are available unless ECS_NO_HUGEPAGES is defined.
+			inline void* AllocatePages(size_t size) {
+#ifdef _WIN32
+				void* ptr = nullptr;
+#ifndef ECS_NO_HUGEPAGES
+				//Large pages require SeLockMemoryPrivilege, fall back to normal pages without it
+				size_t largePage = GetLargePageMinimum();
+				if (largePage != 0 && size % largePage == 0) {
+					ptr = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+				}
+#endif // ECS_NO_HUGEPAGES
+				if (ptr == nullptr) {
+					ptr = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+				}
+				return ptr;
+#else
+#if !defined(ECS_NO_HUGEPAGES) && defined(MAP_HUGETLB)
+				//Explicit huge pages only succeed if the system has some reserved
+				void* huge = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				if (huge != MAP_FAILED) {
+					return huge;
+				}
+#endif
+				//Over-allocate so the region can be aligned to a huge page boundary
+				size_t mapSize = size + hugePageSize;
+				void* mapped = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (mapped == MAP_FAILED) {
+					return nullptr;
+				}
+				uintptr_t start = reinterpret_cast<uintptr_t>(mapped);
+				uintptr_t aligned = (start + hugePageSize - 1) & ~(uintptr_t)(hugePageSize - 1);
+				size_t head = aligned - start;
+				size_t tail = mapSize - head - size;
+				if (head > 0) {
+					munmap(mapped, head);
+				}
+				if (tail > 0) {
+					munmap(reinterpret_cast<void*>(aligned + size), tail);
+				}
+#if !defined(ECS_NO_HUGEPAGES) && defined(MADV_HUGEPAGE)
+				//Ask for transparent huge pages
+				madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+#endif
+				return reinterpret_cast<void*>(aligned);
+#endif // _WIN32
+			}
+
+			//Lets the OS drop the physical pages in [ptr, ptr + size) while keeping the range mapped.
+			//Only whole pages inside the range are discarded, their contents are undefined afterwards.
+			inline void DiscardPages(void* ptr, size_t size) {
+				uintptr_t begin = (reinterpret_cast<uintptr_t>(ptr) + pageSize - 1) & ~(uintptr_t)(pageSize - 1);
+				uintptr_t end = (reinterpret_cast<uintptr_t>(ptr) + size) & ~(uintptr_t)(pageSize - 1);
+				if (end <= begin) {
+					return;
+				}
+#ifdef _WIN32
+				VirtualAlloc(reinterpret_cast<void*>(begin), end - begin, MEM_RESET, PAGE_READWRITE);
+#else
+				madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+#endif // _WIN32
+			}
+
+			inline void FreePages(void* ptr, size_t size) {
+#ifdef _WIN32
+				VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+				munmap(ptr, size);
+#endif // _WIN32
+			}
+		}
+	}
+
+	static_assert(ECS_MAX_ARCHETYPE_COMPONENTS < UINT8_MAX, "Column indices are stored in a byte");
+	static_assert(ECS_COLUMN_ALIGNMENT > 0 && (ECS_COLUMN_ALIGNMENT & (ECS_COLUMN_ALIGNMENT - 1)) == 0, "ECS_COLUMN_ALIGNMENT must be a power of two");
+	static_assert(ECS_COLUMN_ALIGNMENT <= 64, "ECS_COLUMN_ALIGNMENT can be at most 64");
+
+	//One component array inside a memory block
+	struct ComponentColumn {
+		uint32_t offset; //Byte offset of the array from the start of the block's data
+		uint32_t size; //Size of one element
+		size_t componentIndex;
+		const ComponentInfo* lifetime; //Null for trivially copyable components
+	};
+
+	//TODO: invalid block index
+	struct ArchetypeBlockIndex {
+		bool valid = false;
+		size_t archetypeIndex = 0;
+		size_t blockIndex = 0;
+		size_t elementIndex = 0;
+
+		static ArchetypeBlockIndex Invalid() {
+			ArchetypeBlockIndex index;
+			index.valid = false;
+			return index;
+		}
 	};
 
 
@@ -20,51 +157,207 @@ namespace gleng {
 	private:
 		size_t _size = 0;
 		size_t _maxSize = 0;
+
+		//Columns in the archetype's component order, filled once in Initialize
+		ComponentColumn _columns[ECS_MAX_ARCHETYPE_COMPONENTS];
+		size_t _numColumns = 0;
+		//Registry component index -> column, noColumn for components this block doesn't have
+		uint8_t _columnOf[ECS_MAX_COMPONENT_TYPES];
+		static constexpr uint8_t noColumn = UINT8_MAX;
+
+		inline uint8_t* ColumnData(const ComponentColumn& column) {
+			return data + column.offset;
+		}
+
+		//Entity ID -> location, maintained by the owning ComponentManager. Null for standalone blocks.
+		const std::vector<ArchetypeBlockIndex>* _entityMap = nullptr;
+
+		//Row of e in this block according to the entity map, or SIZE_MAX if e isn't here
+		inline size_t MappedIndexOf(const Entity& e) const {
+			if (e.ID >= _entityMap->size()) {
+				return SIZE_MAX;
+			}
+			const ArchetypeBlockIndex &idx = (*_entityMap)[e.ID];
+			if (!idx.valid || idx.elementIndex >= _size
+				|| reinterpret_cast<const Entity*>(data)[idx.elementIndex] != e) {
+				return SIZE_MAX;
+			}
+			return idx.elementIndex;
+		}
+
+		//Called on rows entities have left
+		static inline void ReleaseRows(void* ptr, size_t size) {
+#if defined(ECS_POISON_MEMORY)
+			memset(ptr, ECS_POISON_BYTE, size);
+#elif !defined(ECS_NO_ZERO_MEMORY)
+			memset(ptr, 0, size);
+#else
+			(void)ptr;
+			(void)size;
+#endif
+		}
+
+		//Called on rows of a column that new entities were just added to without moving their data in
+		inline void PrepareNewRows(const ComponentColumn &column, size_t first, size_t count) {
+			if (column.lifetime != nullptr) {
+				column.lifetime->construct(ColumnData(column) + first * column.size, count);
+				return;
+			}
+#ifdef ECS_ZERO_ON_REUSE
+			memset(ColumnData(column) + first * column.size, 0, count * column.size);
+#endif
+		}
+
+		//Moves count components of a column, the moved-from ones at src still need DestroyRows
+		static inline void MoveRows(const ComponentColumn &column, uint8_t* dest, uint8_t* src, size_t count) {
+			if (column.lifetime == nullptr) {
+				memcpy(dest, src, count * column.size);
+			} else {
+				column.lifetime->move(dest, src, count);
+			}
+		}
+
+		static inline void DestroyRows(const ComponentColumn &column, uint8_t* ptr, size_t count) {
+			if (column.lifetime != nullptr) {
+				column.lifetime->destroy(ptr, count);
+			}
+		}
+
+		inline size_t AppendEntities(const Entity* entities, size_t count) {
+			assert(_size + count <= _maxSize);
+
+			size_t first = _size;
+			memcpy(GetEntityArray() + first, entities, count * sizeof(Entity));
+			_size += count;
+			return first;
+		}
+
+		static inline size_t AlignUp(size_t offset, size_t alignment) {
+			return (offset + alignment - 1) & ~(alignment - 1);
+		}
+
+		//Bytes needed to lay out numEntities rows of type, each column starting aligned
+		static inline size_t LayoutSize(const EntityArchetype &type, size_t numEntities) {
+			size_t end = numEntities * sizeof(Entity);
+			for (const ComponentType &t : type.GetComponentTypes()) {
+				end = AlignUp(end, ColumnAlignment(t.alignment)) + numEntities * t.memorySize;
+			}
+			return end;
+		}
+
+		size_t _dataSize = 0;
+		//Storage of standalone blocks, blocks from MemoryBlockAllocator point into their slot instead
+		std::unique_ptr<uint8_t[]> _ownedData;
 	public:
+		//Data size of a block created without a size, and of ChunkSize::Small
 		static const size_t datasize = KB(16);
-		uint8_t data[datasize];
+		static constexpr size_t dataAlignment = 64;
+
+		static inline size_t DataSizeOf(ChunkSize chunkSize) {
+			switch (chunkSize) {
+			case ChunkSize::Medium:
+				return KB(64);
+			case ChunkSize::Large:
+				return KB(256);
+			default:
+				return datasize;
+			}
+		}
+
+		//Data size for archetype's blocks, from its hint or from the size of one entity's components
+		static inline size_t DataSizeFor(const EntityArchetype &archetype) {
+			if (archetype.GetChunkSize() != ChunkSize::Auto) {
+				return DataSizeOf(archetype.GetChunkSize());
+			}
+			size_t rowSize = sizeof(Entity);
+			for (const ComponentType &t : archetype.GetComponentTypes()) {
+				rowSize += t.memorySize;
+			}
+			for (ChunkSize chunkSize : { ChunkSize::Small, ChunkSize::Medium }) {
+				if (DataSizeOf(chunkSize) / rowSize >= ECS_MIN_CHUNK_ENTITIES) {
+					return DataSizeOf(chunkSize);
+				}
+			}
+			return DataSizeOf(ChunkSize::Large);
+		}
+
+		static constexpr size_t ColumnAlignment(size_t componentAlignment) {
+			return componentAlignment > ECS_COLUMN_ALIGNMENT ? componentAlignment : ECS_COLUMN_ALIGNMENT;
+		}
+
+		//Every GetComponentArray<T>() pointer is aligned to at least this many bytes
+		template <class T>
+		static constexpr size_t ColumnAlignment() {
+			return ColumnAlignment(alignof(T));
+		}
+
+		uint8_t* data;
 		EntityArchetype type;
 
-#ifdef ECS_NO_TSL
-		std::unordered_map<type_hash, MemoryPtr, util::typehasher> dataLocations;
-#else
-		tsl::robin_map<type_hash, MemoryPtr, util::typehasher> dataLocations;
-#endif // ECS_NO_TSL
+		//Standalone block with its own datasize bytes of storage
+		inline ComponentMemoryBlock() : _dataSize(datasize) {
+			_ownedData.reset(new uint8_t[datasize + dataAlignment]);
+			data = reinterpret_cast<uint8_t*>(AlignUp(reinterpret_cast<uintptr_t>(_ownedData.get()), dataAlignment));
+		}
 
-		ComponentMemoryBlock() = default;
+		//Block using dataSize bytes of external storage aligned to dataAlignment
+		inline ComponentMemoryBlock(uint8_t* storage, size_t dataSize) : _dataSize(dataSize), data(storage) {
+			assert(reinterpret_cast<uintptr_t>(storage) % dataAlignment == 0);
+		}
 
-		inline void Initialize(const EntityArchetype & type) {
+		inline ~ComponentMemoryBlock() {
+			for (size_t c = 0; c < _numColumns; ++c) {
+				DestroyRows(_columns[c], ColumnData(_columns[c]), _size);
+			}
+		}
+
+		inline void Initialize(const EntityArchetype & type, const std::vector<ArchetypeBlockIndex>* entityMap = nullptr) {
 			this->type = type;
+			_entityMap = entityMap;
 
 			size_t componentSizeCombined = 0;
 
 			//space for entity array
 			componentSizeCombined += sizeof(Entity);
 
-			for (auto t : type.GetComponentTypes()) {
-				assert(t.second > 0);
-				componentSizeCombined += t.second;
+			for (const ComponentType &t : type.GetComponentTypes()) {
+				assert(t.memorySize > 0);
+				assert(t.alignment <= dataAlignment);
+				componentSizeCombined += t.memorySize;
 			}
 
 			assert(componentSizeCombined > 0);
 
-			_maxSize = floor((float)datasize / (float)componentSizeCombined);
+			_maxSize = floor((float)_dataSize / (float)componentSizeCombined);
+			//Alignment padding between columns can cost a few rows
+			while (_maxSize > 0 && LayoutSize(type, _maxSize) > _dataSize) {
+				--_maxSize;
+			}
 
 			size_t nextLoc = _maxSize * sizeof(Entity);//Start from after entity array
 
 			assert(sizeof(data[0]) == 1);
-			assert(sizeof(data) == datasize);
-			for (auto t : type.GetComponentTypes()) {
-				MemoryPtr ptr;
-				ptr.ptr = &data[nextLoc];
-				ptr.size = t.second;
-				dataLocations.emplace(t.first, ptr);
-				nextLoc += _maxSize * t.second;
+			assert(type.GetComponentTypes().size() <= ECS_MAX_ARCHETYPE_COMPONENTS);
+			memset(_columnOf, noColumn, sizeof(_columnOf));
+			_numColumns = 0;
+			for (const ComponentType &t : type.GetComponentTypes()) {
+				nextLoc = AlignUp(nextLoc, ColumnAlignment(t.alignment));
+				ComponentColumn &column = _columns[_numColumns];
+				column.offset = (uint32_t)nextLoc;
+				column.size = (uint32_t)t.memorySize;
+				column.componentIndex = t.index;
+				const ComponentInfo &info = ComponentRegistry::instance().GetInfo(t.index);
+				column.lifetime = info.IsTrivial() ? nullptr : &info;
+				_columnOf[t.index] = (uint8_t)_numColumns;
+				++_numColumns;
+				nextLoc += _maxSize * t.memorySize;
 			}
 
 			_size = 0;
 
-			memset(data, 0, datasize);
+#ifndef ECS_NO_ZERO_MEMORY
+			ReleaseRows(data, _dataSize);
+#endif
 		}
 
 		inline Entity* GetEntityArray() {
@@ -74,12 +367,11 @@ namespace gleng {
 		template <class T>
 		inline T* GetComponentArray() {
 			CHECK_T_IS_COMPONENT;
-			type_hash componentTypeID = IComponent<T>::ComponentTypeID;
+			static_assert(alignof(T) <= dataAlignment, "Component alignment is larger than a memory block supports");
+			uint8_t column = _columnOf[util::GetComponentIndex<T>()];
 
-			assert(dataLocations.find(componentTypeID) != dataLocations.end());
-			MemoryPtr ptr = dataLocations[componentTypeID];
-
-			return static_cast<T*>(ptr.ptr);
+			assert(column != noColumn);
+			return reinterpret_cast<T*>(ColumnData(_columns[column]));
 		}
 
 		template <class T>
@@ -96,12 +388,41 @@ namespace gleng {
 			return GetComponent<T>(idx);
 		}
 
+		//Replaces the component at row idx with a freshly added one. Shared components have no column and are left alone.
+		inline void ResetComponent(size_t idx, size_t componentIndex) {
+			assert(idx < _size);
+			uint8_t c = _columnOf[componentIndex];
+			if (c == noColumn) {
+				return;
+			}
+			const ComponentColumn &column = _columns[c];
+			uint8_t* ptr = ColumnData(column) + idx * column.size;
+			if (column.lifetime != nullptr) {
+				DestroyRows(column, ptr, 1);
+				PrepareNewRows(column, idx, 1);
+			} else {
+				memset(ptr, 0, column.size);
+			}
+		}
+
 		inline size_t AddEntity(const Entity & e) {
 			assert(e.ID != ENTITY_NULL_ID);
 
 			assert(_size < _maxSize);
-			GetEntityArray()[_size] = e;
-			return _size++; //Return old size and increment size by one 
+			size_t idx = AppendEntities(&e, 1);
+			for (size_t c = 0; c < _numColumns; ++c) {
+				PrepareNewRows(_columns[c], idx, 1);
+			}
+			return idx;
+		}
+
+		//Appends count entities in one go, returns the index of the first one
+		inline size_t AddEntities(const Entity* entities, size_t count) {
+			size_t first = AppendEntities(entities, count);
+			for (size_t c = 0; c < _numColumns; ++c) {
+				PrepareNewRows(_columns[c], first, count);
+			}
+			return first;
 		}
 
 		//returns the last entity that was moved in place of eidx
@@ -115,73 +436,170 @@ namespace gleng {
 			size_t lastIdx = _size - 1;
 			if (idx != lastIdx) {
 				//Move last entitys data in place of removed entity
-				for (auto locations : dataLocations) {
-					MemoryPtr mp = locations.second;
-					size_t idxOffset = mp.size * idx;
-					size_t lastIdxOffset = mp.size * lastIdx;
-
-					memcpy(static_cast<char*>(mp.ptr) + idxOffset,
-						(static_cast<char*>(mp.ptr) + lastIdxOffset), mp.size);//copy data from last to idx
-					memset(static_cast<char*>(mp.ptr) + lastIdxOffset, 0, mp.size);//set data of last to zeroes
+				for (size_t c = 0; c < _numColumns; ++c) {
+					const ComponentColumn &column = _columns[c];
+					uint8_t* columnData = ColumnData(column);
+					size_t idxOffset = column.size * idx;
+					size_t lastIdxOffset = column.size * lastIdx;
+
+					DestroyRows(column, columnData + idxOffset, 1);
+					MoveRows(column, columnData + idxOffset, columnData + lastIdxOffset, 1);//move data from last to idx
+					DestroyRows(column, columnData + lastIdxOffset, 1);
+					ReleaseRows(columnData + lastIdxOffset, column.size);
 				}
 
-				Entity e2 = entArr[lastIdx];
 				entArr[idx] = entArr[lastIdx];
-				entArr[lastIdx].ID = ENTITY_NULL_ID; //Change last to be null entity
+				ReleaseRows(entArr + lastIdx, sizeof(Entity)); //Vacate last
+				_size--;
+				return entArr[idx];
 			} else {
-				for (auto locations : dataLocations) {
-					MemoryPtr mp = locations.second;
-					size_t lastIdxOffset = mp.size * lastIdx;
-					memset(static_cast<char*>(mp.ptr) + lastIdxOffset, 0, mp.size);//set data of last to zeroes
+				for (size_t c = 0; c < _numColumns; ++c) {
+					const ComponentColumn &column = _columns[c];
+					DestroyRows(column, ColumnData(column) + column.size * lastIdx, 1);
+					ReleaseRows(ColumnData(column) + column.size * lastIdx, column.size);
 				}
-				entArr[lastIdx].ID = ENTITY_NULL_ID; //Change last to be null entity
-			}
-
-			_size--;
-			if (_size == 0) {
+				ReleaseRows(entArr + lastIdx, sizeof(Entity)); //Vacate last
+				_size--;
 				return Entity();
-			} else {
-				return entArr[idx];
 			}
 		}
 
+		/*
+		Removes the entities at the given ascending indices in one pass.
+		Holes are filled with the surviving entities from the end of the block,
+		and the new indices of those moved survivors are appended to out_movedTo.
+		*/
+		inline void RemoveEntities(const size_t* sortedIndices, size_t count, std::vector<size_t> &out_movedTo) {
+			assert(count <= _size);
+			if (count == 0) {
+				return;
+			}
+
+			size_t newSize = _size - count;
+
+			//Pair every hole below newSize with a surviving entity above it
+			size_t firstMove = out_movedTo.size();
+			std::vector<size_t> sources;
+			size_t victim = count;
+			size_t src = _size;
+			for (size_t i = 0; i < count && sortedIndices[i] < newSize; ++i) {
+				assert(i == 0 || sortedIndices[i - 1] < sortedIndices[i]);
+				do {
+					--src;
+					while (victim > 0 && sortedIndices[victim - 1] > src) {
+						--victim;
+					}
+				} while (victim > 0 && sortedIndices[victim - 1] == src);
+
+				out_movedTo.push_back(sortedIndices[i]);
+				sources.push_back(src);
+			}
 
-		inline size_t CopyEntityTo(size_t eidx, const Entity& e, ComponentMemoryBlock *memblock) {
-			if (eidx >= _size) {
-				int num = 0;
+			size_t numMoves = sources.size();
+			const size_t* dests = out_movedTo.data() + firstMove;
+
+			for (size_t c = 0; c < _numColumns; ++c) {
+				const ComponentColumn &column = _columns[c];
+				uint8_t* columnData = ColumnData(column);
+				if (column.lifetime == nullptr) {
+					for (size_t i = 0; i < numMoves; ++i) {
+						memcpy(columnData + dests[i] * column.size, columnData + sources[i] * column.size, column.size);
+					}
+				} else {
+					for (size_t i = 0; i < count; ++i) {
+						DestroyRows(column, columnData + sortedIndices[i] * column.size, 1);
+					}
+					for (size_t i = 0; i < numMoves; ++i) {
+						MoveRows(column, columnData + dests[i] * column.size, columnData + sources[i] * column.size, 1);
+						DestroyRows(column, columnData + sources[i] * column.size, 1);
+					}
+				}
+				ReleaseRows(columnData + newSize * column.size, count * column.size);
+			}
+
+			Entity* entArr = GetEntityArray();
+			for (size_t i = 0; i < numMoves; ++i) {
+				entArr[dests[i]] = entArr[sources[i]];
 			}
+			ReleaseRows(entArr + newSize, count * sizeof(Entity));//Vacate tail
+
+			_size = newSize;
+		}
+
+		//Moves the entity's components that memblock's archetype has into memblock and default constructs the rest.
+		//The entity stays in this block with moved-from components until it is removed.
+		inline size_t CopyEntityTo(size_t eidx, const Entity& e, ComponentMemoryBlock *memblock) {
 			assert(eidx < _size);
 			assert(e.ID != ENTITY_NULL_ID);
 
-			size_t newIdx = memblock->AddEntity(e); //Add entity to other memoryblock
+			size_t newIdx = memblock->AppendEntities(&e, 1); //Add entity to other memoryblock
 			size_t oldIdx = eidx;
 
 			//Move all data from src to dest
-			for (auto keyval : memblock->dataLocations) {
-				type_hash type = keyval.first;
-				MemoryPtr dest = keyval.second;
+			for (size_t c = 0; c < memblock->_numColumns; ++c) {
+				const ComponentColumn &dest = memblock->_columns[c];
 
-				auto dataloc = dataLocations.find(type);
-				if (dataloc != dataLocations.end()) {
-					MemoryPtr src = dataloc->second;
+				uint8_t srcColumn = _columnOf[dest.componentIndex];
+				if (srcColumn != noColumn) {
+					const ComponentColumn &src = _columns[srcColumn];
 					size_t destOffset = newIdx * dest.size;
 					size_t srcOffset = oldIdx * src.size;
-					size_t size = dest.size;
 
-					memcpy(static_cast<char*>(dest.ptr) + destOffset,
-						(static_cast<char*>(src.ptr) + srcOffset), size);//copy data from old to new
+					MoveRows(dest, memblock->ColumnData(dest) + destOffset,
+						ColumnData(src) + srcOffset, 1);//move data from old to new
+				} else {
+					memblock->PrepareNewRows(dest, newIdx, 1);
 				}
 			}
 			return newIdx;
 		}
 
+		//Appends the last count entities to memblock and removes them from this block.
+		//Returns the index of the first moved entity in memblock.
+		inline size_t MoveLastEntitiesTo(size_t count, ComponentMemoryBlock *memblock) {
+			assert(count <= _size);
+			assert(memblock->_size + count <= memblock->_maxSize);
+
+			size_t first = _size - count;
+			size_t newIdx = memblock->AppendEntities(GetEntityArray() + first, count);
+
+			for (size_t c = 0; c < memblock->_numColumns; ++c) {
+				const ComponentColumn &dest = memblock->_columns[c];
+				uint8_t srcColumn = _columnOf[dest.componentIndex];
+				if (srcColumn != noColumn) {
+					MoveRows(dest, memblock->ColumnData(dest) + newIdx * dest.size,
+						ColumnData(_columns[srcColumn]) + first * dest.size, count);
+				} else {
+					memblock->PrepareNewRows(dest, newIdx, count);
+				}
+			}
+
+			for (size_t c = 0; c < _numColumns; ++c) {
+				const ComponentColumn &column = _columns[c];
+				DestroyRows(column, ColumnData(column) + first * column.size, count);
+				ReleaseRows(ColumnData(column) + first * column.size, count * column.size);
+			}
+			ReleaseRows(GetEntityArray() + first, count * sizeof(Entity));
+
+			_size = first;
+			return newIdx;
+		}
+
 		inline bool HasEntity(const Entity &e) const {
+			if (_entityMap != nullptr) {
+				return MappedIndexOf(e) != SIZE_MAX;
+			}
 			const Entity* begin = reinterpret_cast<const Entity*>(data);
 			const Entity* end = begin + _size;
 			return std::find(begin, end, e) != end;
 		}
 
 		inline size_t GetEntityIndex(const Entity& e) {
+			if (_entityMap != nullptr) {
+				size_t idx = MappedIndexOf(e);
+				assert(idx != SIZE_MAX);
+				return idx;
+			}
 			const Entity* begin = reinterpret_cast<const Entity*>(data);
 			const Entity* end = begin + _size;
 			auto eidx = std::find(begin, end, e);
@@ -197,6 +615,10 @@ namespace gleng {
 			return _maxSize;
 		}
 
+		inline size_t dataSize() const {
+			return _dataSize;
+		}
+
 		inline bool HasRoom() {
 			return _size < _maxSize;
 		}
@@ -205,25 +627,191 @@ namespace gleng {
 		ComponentMemoryBlock(const ComponentMemoryBlock &) = delete;
 	};
 
+	/*
+	Carves ComponentMemoryBlocks out of large page backed regions.
+	Every chunk size has its own pool of regions. A slot holds the block header followed by its data.
+	Freed blocks are kept in an intrusive free list per pool and reused by any archetype,
+	so memory only goes back to the OS on Clear.
+	*/
 	class MemoryBlockAllocator {
 	private:
-		std::vector<ComponentMemoryBlock*> allBlocks;
+		struct ChunkSlot {
+			ChunkSlot* nextFree;
+			bool live;
+			bool discarded; //Free slot whose data pages were given back to the OS
+			alignas(64) uint8_t storage[sizeof(ComponentMemoryBlock)];
+		};
+
+		struct Region {
+			void* memory;
+			size_t size;
+		};
+
+		struct Pool {
+			size_t dataSize = 0;
+			size_t slotSize = 0;
+			size_t regionSize = 0;
+			size_t slotsPerRegion = 0;
+			std::vector<Region> regions;
+			ChunkSlot* freeList = nullptr;
+			size_t liveBlocks = 0;
+		};
+
+		static constexpr size_t minRegionSize = MB(2);
+		static constexpr size_t minSlotsPerRegion = 8;
+		static constexpr size_t dataOffset = (sizeof(ChunkSlot) + ComponentMemoryBlock::dataAlignment - 1) & ~(ComponentMemoryBlock::dataAlignment - 1);
+
+		std::vector<Pool> pools;
+
 		MemoryBlockAllocator() = default;
+
+		static inline ChunkSlot* SlotOf(ComponentMemoryBlock* block) {
+			return reinterpret_cast<ChunkSlot*>(reinterpret_cast<uint8_t*>(block) - offsetof(ChunkSlot, storage));
+		}
+
+		static inline ChunkSlot* SlotAt(const Pool &pool, const Region &region, size_t index) {
+			return reinterpret_cast<ChunkSlot*>(static_cast<uint8_t*>(region.memory) + index * pool.slotSize);
+		}
+
+		inline Pool& PoolFor(size_t dataSize) {
+			for (Pool &pool : pools) {
+				if (pool.dataSize == dataSize) {
+					return pool;
+				}
+			}
+			assert(dataSize % ComponentMemoryBlock::dataAlignment == 0);
+			Pool pool;
+			pool.dataSize = dataSize;
+			pool.slotSize = dataOffset + dataSize;
+			pool.regionSize = minRegionSize;
+			while (pool.regionSize / pool.slotSize < minSlotsPerRegion) {
+				pool.regionSize += minRegionSize;
+			}
+			pool.slotsPerRegion = pool.regionSize / pool.slotSize;
+			pools.push_back(pool);
+			return pools.back();
+		}
+
+		inline void AddRegion(Pool &pool) {
+			Region region;
+			region.size = pool.regionSize;
+			region.memory = util::pages::AllocatePages(region.size);
+			if (region.memory == nullptr) {
+				throw std::bad_alloc();
+			}
+			pool.regions.push_back(region);
+
+			//Push in reverse so blocks are handed out in address order
+			for (size_t i = pool.slotsPerRegion; i > 0; --i) {
+				ChunkSlot* slot = SlotAt(pool, region, i - 1);
+				slot->live = false;
+				slot->discarded = false;
+				slot->nextFree = pool.freeList;
+				pool.freeList = slot;
+			}
+		}
 	public:
-		ComponentMemoryBlock* Allocate() {
-			ComponentMemoryBlock* newBlock = new ComponentMemoryBlock();
+		inline ComponentMemoryBlock* Allocate(size_t dataSize = ComponentMemoryBlock::datasize) {
+			Pool &pool = PoolFor(dataSize);
+			if (pool.freeList == nullptr) {
+				AddRegion(pool);
+			}
 
-			allBlocks.push_back(newBlock);
+			ChunkSlot* slot = pool.freeList;
+			pool.freeList = slot->nextFree;
+			slot->nextFree = nullptr;
+			slot->live = true;
+			slot->discarded = false;
+			++pool.liveBlocks;
 
-			return newBlock;
+			return new(slot->storage) ComponentMemoryBlock(reinterpret_cast<uint8_t*>(slot) + dataOffset, dataSize);
 		}
 
-		ComponentMemoryBlock* Deallocate(ComponentMemoryBlock* block) {
-			auto found = std::find(allBlocks.begin(), allBlocks.end(), block);
-			if (found != allBlocks.end()) {
-				delete(*found);
-				allBlocks.erase(found);
+		inline void Deallocate(ComponentMemoryBlock* block) {
+			if (block == nullptr) {
+				return;
 			}
+			Pool &pool = PoolFor(block->dataSize());
+			ChunkSlot* slot = SlotOf(block);
+			assert(slot->live);
+
+			block->~ComponentMemoryBlock();
+			slot->live = false;
+			slot->nextFree = pool.freeList;
+			pool.freeList = slot;
+			--pool.liveBlocks;
+		}
+
+		inline size_t NumAllocatedBlocks() const {
+			size_t count = 0;
+			for (const Pool &pool : pools) {
+				count += pool.liveBlocks;
+			}
+			return count;
+		}
+
+		inline size_t NumAllocatedBlocks(size_t dataSize) const {
+			for (const Pool &pool : pools) {
+				if (pool.dataSize == dataSize) {
+					return pool.liveBlocks;
+				}
+			}
+			return 0;
+		}
+
+		inline size_t ReservedBytes() const {
+			size_t bytes = 0;
+			for (const Pool &pool : pools) {
+				bytes += pool.regions.size() * pool.regionSize;
+			}
+			return bytes;
+		}
+
+		/*
+		Gives the memory of free blocks back to the OS. Regions without live blocks are unmapped,
+		free blocks in other regions keep their address but drop their data pages.
+		Returns the number of bytes released.
+		*/
+		inline size_t ReleaseFreeMemory() {
+			size_t released = 0;
+			for (Pool &pool : pools) {
+				size_t kept = 0;
+				for (size_t r = 0; r < pool.regions.size(); ++r) {
+					Region region = pool.regions[r];
+					bool anyLive = false;
+					for (size_t i = 0; i < pool.slotsPerRegion && !anyLive; ++i) {
+						anyLive = SlotAt(pool, region, i)->live;
+					}
+					if (!anyLive) {
+						util::pages::FreePages(region.memory, region.size);
+						released += region.size;
+						continue;
+					}
+					for (size_t i = 0; i < pool.slotsPerRegion; ++i) {
+						ChunkSlot* slot = SlotAt(pool, region, i);
+						if (!slot->live && !slot->discarded) {
+							util::pages::DiscardPages(reinterpret_cast<uint8_t*>(slot) + dataOffset, pool.dataSize);
+							slot->discarded = true;
+							released += pool.dataSize;
+						}
+					}
+					pool.regions[kept++] = region;
+				}
+				pool.regions.resize(kept);
+
+				//Rebuild the free list from the remaining regions, in address order
+				pool.freeList = nullptr;
+				for (size_t r = pool.regions.size(); r > 0; --r) {
+					for (size_t i = pool.slotsPerRegion; i > 0; --i) {
+						ChunkSlot* slot = SlotAt(pool, pool.regions[r - 1], i - 1);
+						if (!slot->live) {
+							slot->nextFree = pool.freeList;
+							pool.freeList = slot;
+						}
+					}
+				}
+			}
+			return released;
 		}
 
 		static MemoryBlockAllocator& instance() {
@@ -235,10 +823,18 @@ namespace gleng {
 		void operator=(MemoryBlockAllocator const&) = delete;
 
 		inline void Clear() {
-			for (ComponentMemoryBlock* block : allBlocks) {
-				delete(block);
+			for (Pool &pool : pools) {
+				for (Region& region : pool.regions) {
+					for (size_t i = 0; i < pool.slotsPerRegion; ++i) {
+						ChunkSlot* slot = SlotAt(pool, region, i);
+						if (slot->live) {
+							reinterpret_cast<ComponentMemoryBlock*>(slot->storage)->~ComponentMemoryBlock();
+						}
+					}
+					util::pages::FreePages(region.memory, region.size);
+				}
 			}
-			allBlocks.clear();
+			pools.clear();
 		}
 
 		inline ~MemoryBlockAllocator() {
@@ -246,10 +842,27 @@ namespace gleng {
 		}
 	};
 
+	namespace util {
+		//Hashes shared component values for interning. Types without a std::hash specialization
+		//all land in one bucket and are told apart by operator== alone.
+		template<class T>
+		inline auto SharedValueHash(const T& value, int) -> decltype(std::hash<T>()(value)) {
+			return std::hash<T>()(value);
+		}
+
+		template<class T>
+		inline size_t SharedValueHash(const T&, long) {
+			return 0;
+		}
+	}
+
 	struct SharedComponentMemory {
 		type_hash type;
 		size_t memorySize;
 		std::shared_ptr<void> memoryLocation;
+		size_t refCount = 1;
+		bool interned = false;
+		size_t valueHash = 0;
 
 		inline bool operator ==(const void* other) {
 			return (memoryLocation.get()) == other;
@@ -260,7 +873,32 @@ namespace gleng {
 	private:
 		std::unordered_multimap<type_hash, SharedComponentMemory> sharedComponents;
 
+		struct InternKey {
+			type_hash type;
+			size_t valueHash;
+
+			inline bool operator ==(const InternKey& other) const {
+				return type == other.type && valueHash == other.valueHash;
+			}
+		};
+
+		struct InternKeyHasher {
+			inline size_t operator()(const InternKey& key) const {
+				return key.type ^ (key.valueHash + 0x9e3779b9 + (key.type << 6) + (key.type >> 2));
+			}
+		};
+
+		//Points into sharedComponents, whose elements stay put until erased
+		struct InternedComponent {
+			void* component;
+			SharedComponentMemory* memory;
+		};
+
+		//canonical instances by type and value hash
+		std::unordered_multimap<InternKey, InternedComponent, InternKeyHasher> internedComponents;
+
 		SharedComponentAllocator() = default;
+
 	public:
 
 		template<class T>
@@ -279,6 +917,41 @@ namespace gleng {
 			return ptr.get();
 		}
 
+		/*
+		Returns the canonical instance holding a value equal to the given one, creating it if needed.
+		Every call adds a reference which is released with Deallocate.
+		Interned instances must not be modified, otherwise later lookups won't find them.
+		*/
+		template<class T>
+		inline T* Intern(const T& value) {
+			CHECK_T_IS_SHARED_COMPONENT;
+			InternKey key = { ISharedComponent<T>::ComponentTypeID, util::SharedValueHash(value, 0) };
+
+			//Same type is guaranteed by the key, so the cast is safe
+			auto result = internedComponents.equal_range(key);
+			for (auto it = result.first; it != result.second; ++it) {
+				T* existing = static_cast<T*>(it->second.component);
+				if (*existing == value) {
+					++it->second.memory->refCount;
+					return existing;
+				}
+			}
+
+			SharedComponentMemory memory;
+			memory.type = key.type;
+			memory.memorySize = sizeof(T);
+			memory.interned = true;
+			memory.valueHash = key.valueHash;
+
+			std::shared_ptr<T> ptr = std::make_shared<T>(value);
+			memory.memoryLocation = ptr;
+
+			auto inserted = sharedComponents.emplace(memory.type, memory);
+			InternedComponent interned = { ptr.get(), &inserted->second };
+			internedComponents.emplace(key, interned);
+			return ptr.get();
+		}
+
 		template<class T>
 		inline void Deallocate(T* component) {
 			CHECK_T_IS_SHARED_COMPONENT;
@@ -288,12 +961,30 @@ namespace gleng {
 			auto result = sharedComponents.equal_range(type);
 			for (auto it = result.first; it != result.second; ++it) {
 				if (it->second == component) {
-					sharedComponents.erase(it->first);
+					SharedComponentMemory& memory = it->second;
+					if (--memory.refCount > 0) {
+						return;
+					}
+					if (memory.interned) {
+						InternKey key = { type, memory.valueHash };
+						auto interned = internedComponents.equal_range(key);
+						for (auto iit = interned.first; iit != interned.second; ++iit) {
+							if (iit->second.component == component) {
+								internedComponents.erase(iit);
+								break;
+							}
+						}
+					}
+					sharedComponents.erase(it);
 					break;
 				}
 			}
 		}
 
+		inline size_t NumAllocated() const {
+			return sharedComponents.size();
+		}
+
 
 		static SharedComponentAllocator& instance() {
 			static SharedComponentAllocator instance;
@@ -301,6 +992,7 @@ namespace gleng {
 		}
 
 		inline void Clear() {
+			internedComponents.clear();
 			sharedComponents.clear();
 		}
 
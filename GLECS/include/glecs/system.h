@@ -11,6 +11,10 @@ namespace gleng {
 	class IComponentSystem {
 	public:
 		bool running = true;
+		//Run DoWork for different chunks concurrently on the ThreadPool. DoWork must then be safe to call from several threads.
+		bool parallel = false;
+		//Number of chunks handed to a thread at a time when running in parallel
+		size_t parallelBatchSize = 1;
 		virtual void DoWork(double deltaTime, const ComponentDatablock<Components...>&) = 0;
 		virtual inline void BeforeWork(double deltaTime, const WorldAccessor& world) {}
 		virtual inline void AfterWork(double deltaTime, const WorldAccessor& world) {}
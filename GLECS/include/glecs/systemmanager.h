@@ -1,12 +1,43 @@
 #pragma once
 #include "system.h"
 #include "worldaccessor.h"
+#include "threadpool.h"
+#include <algorithm>
 
 namespace gleng {
 
+	namespace util {
+		//Collects the components a system reads and writes. const T is read-only, everything else is a write.
+		template <class T>
+		struct ComponentAccess {
+			static void Add(ComponentMask &, ComponentMask &writes) {
+				writes.Set(GetComponentIndex<T>());
+			}
+		};
+
+		template <class T>
+		struct ComponentAccess<const T> {
+			static void Add(ComponentMask &reads, ComponentMask &) {
+				reads.Set(GetComponentIndex<T>());
+			}
+		};
+
+		template <class T>
+		struct ComponentAccess<Optional<T>> : ComponentAccess<T> {};
+	}
+
 	class ISystemExecutor {
 	public:
 		virtual void ExecuteSystem(const WorldAccessor& world, double deltaTime) = 0;
+
+		//Called on the updating thread before any system of the frame runs
+		virtual void Prepare(const WorldAccessor&) {}
+
+		//Returns false if the accessed components are unknown, the system then can't run next to any other system
+		virtual bool GetAccess(ComponentMask &, ComponentMask &) const {
+			return false;
+		}
+
 		virtual ~ISystemExecutor() = default;
 	};
 
@@ -16,13 +47,36 @@ namespace gleng {
 		IComponentSystem<Args...> *system;
 		std::vector<ComponentDatablock<Args...>> data;
 		ComponentQuery query;
+		ComponentManager *registeredWith = nullptr;
+		query_id cachedQuery = QUERY_ID_NONE;
 	public:
+		inline virtual void Prepare(const WorldAccessor& world) {
+			if (registeredWith != world.componentmanager) {
+				cachedQuery = world.RegisterQuery(query);
+				registeredWith = world.componentmanager;
+			}
+		}
+
+		inline virtual bool GetAccess(ComponentMask &out_reads, ComponentMask &out_writes) const {
+			int _[] = { 0, (util::ComponentAccess<Args>::Add(out_reads, out_writes), 0)... };
+			(void)_;
+			return true;
+		}
+
 		inline virtual void ExecuteSystem(const WorldAccessor& world, double deltaTime) {
 			system->BeforeWork(deltaTime, world);
 
-			world.GetComponentData(data, query);
-			for (auto block : data) {
-				system->DoWork(deltaTime, block);
+			Prepare(world);
+			world.GetComponentData(data, cachedQuery);
+			if (system->parallel) {
+				//ParallelFor returns only after every chunk is done, so AfterWork sees all the work
+				ThreadPool::instance().ParallelFor(data.size(), system->parallelBatchSize, [this, deltaTime](size_t i) {
+					system->DoWork(deltaTime, data[i]);
+				});
+			} else {
+				for (auto block : data) {
+					system->DoWork(deltaTime, block);
+				}
 			}
 			system->AfterWork(deltaTime, world);
 		}
@@ -55,23 +109,116 @@ namespace gleng {
 		}
 	};
 
+	/*
+	Systems run in registration order by default.
+	With parallel scheduling on, a system only waits for the earlier systems it conflicts with:
+	one of them writes a component the other reads or writes. Systems are grouped into levels by
+	that dependency graph and the systems of one level run concurrently on the ThreadPool.
+	ISystems have unknown access and always run alone.
+	BeforeWork and AfterWork of concurrently scheduled systems must not make structural changes.
+	*/
 	class SystemManager {
 	private:
+		struct SystemAccess {
+			bool known;
+			ComponentMask reads;
+			ComponentMask writes;
+		};
+
 		std::vector<ISystemExecutor*> systemExecutors;
 
+		bool parallelScheduling = false;
+		bool scheduleDirty = true;
+		//Systems ordered by level, levelStarts[i] is the first system of level i
+		std::vector<ISystemExecutor*> schedule;
+		std::vector<size_t> levelStarts;
+
+		static inline bool Conflicts(const SystemAccess &a, const SystemAccess &b) {
+			if (!a.known || !b.known) {
+				return true;
+			}
+			return a.writes.ContainsAny(b.writes) || a.writes.ContainsAny(b.reads) || b.writes.ContainsAny(a.reads);
+		}
+
+		inline void BuildSchedule() {
+			std::vector<SystemAccess> access(systemExecutors.size());
+			std::vector<size_t> levels(systemExecutors.size(), 0);
+			size_t numLevels = 0;
+
+			for (size_t i = 0; i < systemExecutors.size(); ++i) {
+				access[i].known = systemExecutors[i]->GetAccess(access[i].reads, access[i].writes);
+				//Run after every earlier system this one conflicts with
+				for (size_t j = 0; j < i; ++j) {
+					if (levels[j] + 1 > levels[i] && Conflicts(access[i], access[j])) {
+						levels[i] = levels[j] + 1;
+					}
+				}
+				numLevels = std::max(numLevels, levels[i] + 1);
+			}
+
+			schedule.clear();
+			levelStarts.clear();
+			for (size_t level = 0; level < numLevels; ++level) {
+				levelStarts.push_back(schedule.size());
+				for (size_t i = 0; i < systemExecutors.size(); ++i) {
+					if (levels[i] == level) {
+						schedule.push_back(systemExecutors[i]);
+					}
+				}
+			}
+			levelStarts.push_back(schedule.size());
+			scheduleDirty = false;
+		}
+
 	public:
 		template <class ...Args>
 		inline void RegisterSystem(IComponentSystem<Args...> *system) {
 			systemExecutors.push_back(new ComponentSystemExecutor<Args...>(system));
+			scheduleDirty = true;
 		}
 
 		inline void RegisterSystem(ISystem *system) {
 			systemExecutors.push_back(new GenericSystemExecutor(system));
+			scheduleDirty = true;
+		}
+
+		inline void SetParallelScheduling(bool enabled) {
+			parallelScheduling = enabled;
+		}
+
+		//Number of system groups that run one after another. Equal to the system count without parallel scheduling.
+		inline size_t GetLevelCount() {
+			if (!parallelScheduling) {
+				return systemExecutors.size();
+			}
+			if (scheduleDirty) {
+				BuildSchedule();
+			}
+			return levelStarts.size() - 1;
 		}
 
 		inline void Update(const WorldAccessor& world, double deltaTime) {
-			for (ISystemExecutor *system : systemExecutors) {
-				system->ExecuteSystem(world, deltaTime);
+			if (!parallelScheduling) {
+				for (ISystemExecutor *system : systemExecutors) {
+					system->ExecuteSystem(world, deltaTime);
+				}
+				return;
+			}
+
+			if (scheduleDirty) {
+				BuildSchedule();
+			}
+
+			for (ISystemExecutor *system : schedule) {
+				system->Prepare(world);
+			}
+
+			for (size_t level = 0; level + 1 < levelStarts.size(); ++level) {
+				size_t first = levelStarts[level];
+				size_t count = levelStarts[level + 1] - first;
+				ThreadPool::instance().ParallelFor(count, 1, [this, first, &world, deltaTime](size_t i) {
+					schedule[first + i]->ExecuteSystem(world, deltaTime);
+				});
 			}
 		}
 
@@ -84,6 +231,8 @@ namespace gleng {
 				delete(system);
 			}
 			systemExecutors.clear();
+			parallelScheduling = false;
+			scheduleDirty = true;
 		}
 	};
 
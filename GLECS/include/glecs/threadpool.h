@@ -0,0 +1,198 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace gleng {
+
+	/*
+	Work-stealing thread pool. Every worker owns a queue, pops its own work from the back
+	and steals from the front of the other queues when it runs out.
+	A thread waiting in ParallelFor runs queued tasks too, so nested ParallelFor calls can't deadlock.
+	Tasks must not throw.
+	*/
+	class ThreadPool {
+		struct Task {
+			void(*function)(void* context, size_t begin, size_t end);
+			void* context;
+			size_t begin;
+			size_t end;
+			std::atomic<size_t>* remaining;
+		};
+
+		struct WorkQueue {
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+
+		std::vector<std::thread> _threads;
+		std::unique_ptr<WorkQueue[]> _queues;
+		size_t _numQueues = 0;
+
+		std::atomic<size_t> _pending{ 0 };
+		std::atomic<size_t> _nextQueue{ 0 };
+		std::atomic<bool> _stop{ false };
+		std::mutex _sleepMutex;
+		std::condition_variable _wake;
+
+		static constexpr size_t notAWorker = SIZE_MAX;
+
+		//Index of the worker queue the current thread owns in this pool
+		inline size_t& WorkerIndex() {
+			static thread_local size_t index = notAWorker;
+			static thread_local const ThreadPool* owner = nullptr;
+			if (owner != this) {
+				owner = this;
+				index = notAWorker;
+			}
+			return index;
+		}
+
+		inline bool PopTask(size_t queueIndex, bool fromBack, Task &out_task) {
+			WorkQueue &queue = _queues[queueIndex];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty()) {
+				return false;
+			}
+			if (fromBack) {
+				out_task = queue.tasks.back();
+				queue.tasks.pop_back();
+			} else {
+				out_task = queue.tasks.front();
+				queue.tasks.pop_front();
+			}
+			_pending.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		inline bool TryRunOne(size_t home) {
+			Task task;
+			bool found = false;
+			if (home != notAWorker) {
+				found = PopTask(home, true, task);
+			}
+			size_t start = home == notAWorker ? 0 : home + 1;
+			for (size_t i = 0; !found && i < _numQueues; ++i) {
+				size_t victim = (start + i) % _numQueues;
+				if (victim != home) {
+					found = PopTask(victim, false, task);
+				}
+			}
+			if (!found) {
+				return false;
+			}
+
+			task.function(task.context, task.begin, task.end);
+			task.remaining->fetch_sub(1, std::memory_order_release);
+			return true;
+		}
+
+		inline void WorkerLoop(size_t index) {
+			WorkerIndex() = index;
+			while (!_stop.load(std::memory_order_acquire)) {
+				if (TryRunOne(index)) {
+					continue;
+				}
+				std::unique_lock<std::mutex> lock(_sleepMutex);
+				_wake.wait(lock, [this]() {
+					return _stop.load(std::memory_order_acquire) || _pending.load(std::memory_order_relaxed) > 0;
+				});
+			}
+		}
+
+	public:
+		//numThreads == 0 runs everything on the calling thread
+		inline explicit ThreadPool(size_t numThreads) {
+			_numQueues = numThreads;
+			if (numThreads > 0) {
+				_queues.reset(new WorkQueue[numThreads]);
+			}
+			for (size_t i = 0; i < numThreads; ++i) {
+				_threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+			}
+		}
+
+		inline ~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(_sleepMutex);
+				_stop.store(true, std::memory_order_release);
+			}
+			_wake.notify_all();
+			for (std::thread &thread : _threads) {
+				thread.join();
+			}
+		}
+
+		inline size_t ThreadCount() const {
+			return _threads.size();
+		}
+
+		/*
+		Calls function(i) for every i in [0, count), in batches of batchSize indices.
+		Returns once every call has finished. The calling thread works on the batches as well.
+		*/
+		template <class F>
+		inline void ParallelFor(size_t count, size_t batchSize, F&& function) {
+			if (batchSize == 0) {
+				batchSize = 1;
+			}
+			if (_numQueues == 0 || count <= batchSize) {
+				for (size_t i = 0; i < count; ++i) {
+					function(i);
+				}
+				return;
+			}
+
+			typedef typename std::remove_reference<F>::type FunctionType;
+			auto runBatch = [](void* context, size_t begin, size_t end) {
+				FunctionType &f = *static_cast<FunctionType*>(context);
+				for (size_t i = begin; i < end; ++i) {
+					f(i);
+				}
+			};
+
+			size_t numTasks = (count + batchSize - 1) / batchSize;
+			std::atomic<size_t> remaining{ numTasks };
+
+			size_t queueIndex = _nextQueue.fetch_add(1, std::memory_order_relaxed);
+			for (size_t t = 0; t < numTasks; ++t) {
+				Task task;
+				task.function = runBatch;
+				task.context = const_cast<void*>(static_cast<const void*>(&function));
+				task.begin = t * batchSize;
+				task.end = task.begin + batchSize < count ? task.begin + batchSize : count;
+				task.remaining = &remaining;
+
+				WorkQueue &queue = _queues[(queueIndex + t) % _numQueues];
+				std::lock_guard<std::mutex> lock(queue.mutex);
+				queue.tasks.push_back(task);
+				_pending.fetch_add(1, std::memory_order_relaxed);
+			}
+			{
+				std::lock_guard<std::mutex> lock(_sleepMutex);
+			}
+			_wake.notify_all();
+
+			size_t home = WorkerIndex();
+			while (remaining.load(std::memory_order_acquire) > 0) {
+				if (!TryRunOne(home)) {
+					std::this_thread::yield();
+				}
+			}
+		}
+
+		static ThreadPool& instance() {
+			static ThreadPool instance(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0);
+			return instance;
+		}
+
+		ThreadPool(ThreadPool const&) = delete;
+		void operator=(ThreadPool const&) = delete;
+	};
+}
@@ -8,6 +8,7 @@
 
 
 #define KB(x)   ((size_t) (x) << 10)
+#define MB(x)   ((size_t) (x) << 20)
 
 typedef size_t type_hash;
 
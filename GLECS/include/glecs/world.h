@@ -4,6 +4,7 @@
 #include "systemmanager.h"
 #include "eventmanager.h"
 #include "componentquery.h"
+#include "entitycommandbuffer.h"
 
 namespace gleng {
 
@@ -19,6 +19,15 @@ namespace gleng {
 			return componentmanager->GetComponentDataBlocks(out_datablocks, query);
 		}
 
+		inline query_id RegisterQuery(const ComponentQuery& query) const {
+			return componentmanager->RegisterQuery(query);
+		}
+
+		template <class ...Components>
+		inline size_t GetComponentData(std::vector<ComponentDatablock<Components...>> &out_datablocks, query_id query) const {
+			return componentmanager->GetComponentDataBlocks(out_datablocks, query);
+		}
+
 		template <class ...Components>
 		inline size_t GetComponentData(std::vector<ComponentDatablock<Components...>> &out_datablocks) const{
 			static ComponentQuery query = ComponentQueryBuilder().Include<Components...>().Build();